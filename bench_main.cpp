@@ -0,0 +1,334 @@
+#include "macros.h"
+#include "random.h"
+#include "realtime.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// Micro-benchmarks for the parts of the server whose speed matters.
+//
+//   bench parse [count]   parses 'count' generated macros (default 10000)
+//                         with the original istringstream parser and with
+//                         the current lexer, and reports both.
+//   bench jitter [waits]  plays 'waits' 1 ms waits on a null controller,
+//                         from a normal thread and from a pinned SCHED_FIFO
+//                         one, with every CPU kept busy, and reports how
+//                         late the waits woke up in each.
+
+namespace chrono = std::chrono;
+namespace fs = std::filesystem;
+
+// The parser macros were loaded with before the lexer, kept here only to
+// compare against. It builds a closure per command, as it did then; the
+// closures are never run.
+namespace legacy {
+
+using macro_fn = std::function<void(controller, const void *)>;
+using macro_sequence = std::vector<macro_fn>;
+using build_ret = std::optional<
+    std::pair<macro_sequence,
+              std::optional<std::tuple<duration_t, duration_t, duration_t>>>>;
+
+inline build_ret build_macro(const fs::path &unit) {
+  macro_sequence sequence;
+  std::ifstream file(unit);
+  std::string line;
+
+  if (!file.is_open()) {
+    return {};
+  }
+
+  std::optional<std::tuple<duration_t, duration_t, duration_t>> spec = {};
+  auto trailing = [](std::stringstream &ss) {
+    std::string rest;
+    return bool(ss >> rest);
+  };
+
+  while (std::getline(file, line)) {
+    if (line == "") {
+      continue;
+    }
+
+    std::stringstream ss(line);
+    char comment;
+    if ((ss >> comment) && comment == '#') {
+      continue;
+    }
+
+    ss.str(line);
+    ss.clear();
+
+    std::string command;
+    ss >> command;
+    if (command == "cooldown") {
+      char bracket_open, bracket_close;
+      int base, increment, max;
+      if (!(ss >> bracket_open) || bracket_open != '[' || !(ss >> base) ||
+          !(ss.ignore(1, ',')) || !(ss >> increment) ||
+          !(ss.ignore(1, ',')) || !(ss >> max) || !(ss >> bracket_close) ||
+          bracket_close != ']') {
+        return {};
+      }
+      spec = {chrono::milliseconds(base), chrono::milliseconds(increment),
+              chrono::milliseconds(max)};
+    } else if (command == "press" || command == "release") {
+      std::string key;
+      if (!(ss >> key) || trailing(ss)) {
+        return {};
+      }
+      bool press = command == "press";
+      sequence.push_back([key, press](controller c, const void *) {
+        if (key == "ALL") {
+          return;
+        }
+        auto code = profiles[gamepad_profile].find_key(key);
+        if (code) {
+          press ? press_button(c, *code) : release_button(c, *code);
+        }
+      });
+    } else if (command == "wait") {
+      int time_ms;
+      if (!(ss >> time_ms)) {
+        return {};
+      }
+      sequence.push_back([time_ms](controller c, const void *) {
+        sync(c);
+        (void)time_ms;
+      });
+    } else if (command == "joy_l" || command == "joy_r") {
+      char bracket_open, bracket_close;
+      float x, y;
+      if (!(ss >> bracket_open) || bracket_open != '[' || !(ss >> x) ||
+          !(ss.ignore(1, ',')) || !(ss >> y) || !(ss >> bracket_close) ||
+          bracket_close != ']' || trailing(ss)) {
+        return {};
+      }
+      side s = command == "joy_l" ? side::left : side::right;
+      sequence.push_back([x, y, s](controller c, const void *) {
+        set_joystick(c, profiles[gamepad_profile], s, {x, y});
+      });
+    } else {
+      std::cerr << "Unknown command: " << command << std::endl;
+    }
+  }
+
+  sequence.push_back([](controller c, const void *) { sync(c); });
+  return std::pair{sequence, spec};
+}
+
+} // namespace legacy
+
+// A macro in the subset both parsers understand: presses, releases, waits,
+// sticks and a cooldown. 'play' is left out because the old parser never
+// handled its closing bracket.
+std::string generate_macro(xoshiro256 &gen) {
+  static constexpr std::string_view keys[] = {
+      "A", "B", "X", "Y", "START", "DPAD_UP", "DPAD_LEFT", "TL2", "THUMBR"};
+  std::ostringstream os;
+  os << "# generated\n";
+  if (gen.below(2)) {
+    os << "cooldown [" << 100 * (1 + gen.below(10)) << ", 500, 3000]\n";
+  }
+  const uint64_t lines = 10 + gen.below(40);
+  for (uint64_t n = 0; n < lines; n++) {
+    switch (gen.below(4)) {
+    case 0: {
+      auto key = keys[gen.below(std::size(keys))];
+      os << "press " << key << "\nwait " << gen.below(200) << "\nrelease "
+         << key << "\n";
+      break;
+    }
+    case 1:
+      os << "wait " << gen.below(1000) << "\n";
+      break;
+    default:
+      os << (gen.below(2) ? "joy_l" : "joy_r") << " ["
+         << gen.unit() * 2 - 1 << ", " << gen.unit() * 2 - 1 << "]\n";
+      break;
+    }
+  }
+  return os.str();
+}
+
+template <typename F> double seconds_for(F &&f) {
+  auto start = chrono::steady_clock::now();
+  f();
+  return chrono::duration<double>(chrono::steady_clock::now() - start)
+      .count();
+}
+
+int bench_parse(size_t count) {
+  char tmpl[] = "/tmp/barcode-bench-XXXXXX";
+  if (!mkdtemp(tmpl)) {
+    std::cerr << "Failed to create a scratch directory" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const fs::path dir = tmpl;
+
+  xoshiro256 gen(42);
+  std::vector<fs::path> files;
+  uint64_t bytes = 0;
+  for (size_t n = 0; n < count; n++) {
+    files.push_back(dir / std::to_string(n));
+    std::ofstream f(files.back());
+    std::string src = generate_macro(gen);
+    bytes += src.size();
+    f << src;
+  }
+
+  size_t old_ok = 0, new_ok = 0;
+  // One untimed pass each so both start with a warm page cache.
+  for (const auto &f : files) {
+    legacy::build_macro(f);
+    build_macro(f);
+  }
+  double old_s = seconds_for([&] {
+    for (const auto &f : files) {
+      old_ok += legacy::build_macro(f).has_value();
+    }
+  });
+  double new_s = seconds_for([&] {
+    for (const auto &f : files) {
+      new_ok += build_macro(f).has_value();
+    }
+  });
+  fs::remove_all(dir);
+
+  if (old_ok != count || new_ok != count) {
+    std::cerr << "Parse failures: old " << count - old_ok << ", new "
+              << count - new_ok << std::endl;
+    return EXIT_FAILURE;
+  }
+  const double mb = bytes / 1e6;
+  std::cout << "Parsed " << count << " macros (" << mb << " MB)\n"
+            << "  old parser: " << old_s << " s, " << count / old_s
+            << " macros/s, " << mb / old_s << " MB/s\n"
+            << "  lexer:      " << new_s << " s, " << count / new_s
+            << " macros/s, " << mb / new_s << " MB/s\n"
+            << "  speedup:    " << old_s / new_s << "x" << std::endl;
+  return EXIT_SUCCESS;
+}
+
+// Wake-up lateness of every wait played on this thread.
+std::vector<chrono::nanoseconds> overshoots;
+
+// Plays 'seq' on a null controller, on a new thread that is made real-time
+// first if 'cpu' is set, and returns how late each of its waits woke up.
+std::vector<chrono::nanoseconds> play_timed(const macro_sequence &seq,
+                                            std::optional<int> cpu) {
+  std::vector<chrono::nanoseconds> out;
+  std::thread([&] {
+    if (cpu) {
+      make_realtime(*cpu, 50);
+    }
+    overshoots.reserve(seq.code.size());
+    controller_set devices(true);
+    context_t context = [](const macro &) { return sequence_ptr(); };
+    play_sequence(devices, seq, &context);
+    out = std::move(overshoots);
+    overshoots.clear();
+  }).join();
+  return out;
+}
+
+void print_jitter(const std::string &name,
+                  std::vector<chrono::nanoseconds> late) {
+  std::sort(late.begin(), late.end());
+  auto us = [&](double q) {
+    return chrono::duration<double, std::micro>(
+               late[std::min(late.size() - 1, (size_t)(q * late.size()))])
+        .count();
+  };
+  std::cout << "  " << name << "p50 " << us(0.5) << " us, p99 " << us(0.99)
+            << " us, max " << us(1) << " us\n";
+}
+
+int bench_jitter(size_t waits) {
+  char path[] = "/tmp/barcode-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    std::cerr << "Failed to create a scratch file" << std::endl;
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  {
+    std::ofstream f(path);
+    for (size_t n = 0; n < waits; n += 2) {
+      f << "press A\nwait 1\nrelease A\nwait 1\n";
+    }
+  }
+  auto built = build_macro(path);
+  fs::remove(path);
+  if (!built) {
+    std::cerr << "Failed to build the jitter macro" << std::endl;
+    return EXIT_FAILURE;
+  }
+  playback_log = false;
+  on_wait_overshoot = [](chrono::nanoseconds late) {
+    overshoots.push_back(late);
+  };
+
+  // One spinning thread per CPU, so a wait's thread has to be scheduled
+  // back in against them, as on a loaded machine.
+  const std::vector<int> cpus = allowed_cpus();
+  std::atomic_bool spin = true;
+  std::vector<std::thread> busy;
+  for (size_t n = 0; n < cpus.size(); n++) {
+    busy.emplace_back([&] {
+      while (spin.load(std::memory_order_relaxed)) {
+      }
+    });
+  }
+  auto normal = play_timed(built->first, {});
+  auto realtime = play_timed(built->first, cpus.back());
+  spin = false;
+  for (auto &t : busy) {
+    t.join();
+  }
+
+  std::cout << "Wait overshoot over " << normal.size() << " waits with "
+            << busy.size() << " busy threads\n";
+  print_jitter("normal thread:    ", std::move(normal));
+  print_jitter("SCHED_FIFO, CPU " + std::to_string(cpus.back()) + ": ",
+               std::move(realtime));
+  std::cout << std::flush;
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  std::string_view mode = argc > 1 ? argv[1] : "";
+  if (mode == "parse") {
+    size_t count = 10000;
+    if (argc > 2 && (!parse_number(std::string_view(argv[2]), count) ||
+                     count == 0)) {
+      std::cerr << "Invalid count: " << argv[2] << std::endl;
+      return EXIT_FAILURE;
+    }
+    return bench_parse(count);
+  }
+  if (mode == "jitter") {
+    size_t waits = 2000;
+    if (argc > 2 && (!parse_number(std::string_view(argv[2]), waits) ||
+                     waits == 0)) {
+      std::cerr << "Invalid count: " << argv[2] << std::endl;
+      return EXIT_FAILURE;
+    }
+    return bench_jitter(waits);
+  }
+  std::cerr << "Usage: " << argv[0] << " parse [count] | jitter [waits]"
+            << std::endl;
+  return EXIT_FAILURE;
+}
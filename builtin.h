@@ -0,0 +1,65 @@
+#pragma once
+#include "macros.h"
+#include "sha256.h"
+#include <span>
+#include <string_view>
+
+// Shapes of the macro table that macrogen compiles into builtin_macros.h.
+// Everything here is a literal type so the whole table is constexpr data.
+
+constexpr macro digest_of(std::string_view barcode) {
+  auto d = ct::sha256(barcode);
+  macro m{};
+  for (size_t i = 0; i < d.size(); i++) {
+    m.data[i] = d[i];
+  }
+  return m;
+}
+
+// One entry of a play command's alias table, precomputed by macrogen.
+struct builtin_target {
+  std::string_view name;
+  macro digest;
+  float prob;
+  uint32_t alias;
+};
+
+struct builtin_macro {
+  macro digest;
+  std::span<const instr> code;
+  std::span<const std::span<const builtin_target>> plays;
+  bool has_cooldown;
+  uint32_t base_ms, increment_ms, max_ms;
+  cooldown_scope scope;
+  std::string_view group;
+  uint8_t profile;
+};
+
+inline macro_sequence to_sequence(const builtin_macro &b) {
+  macro_sequence seq;
+  seq.code.assign(b.code.begin(), b.code.end());
+  seq.profile = b.profile;
+  for (const auto &targets : b.plays) {
+    play_table table;
+    for (const auto &t : targets) {
+      table.targets.push_back(t.digest);
+      table.names.emplace_back(t.name);
+      table.prob.push_back(t.prob);
+      table.alias.push_back(t.alias);
+    }
+    seq.plays.push_back(std::move(table));
+  }
+  return seq;
+}
+
+inline macro_meta to_meta(const builtin_macro &b) {
+  macro_meta meta;
+  if (b.has_cooldown) {
+    meta.cooldown = {chrono::milliseconds(b.base_ms),
+                     chrono::milliseconds(b.increment_ms),
+                     chrono::milliseconds(b.max_ms)};
+  }
+  meta.scope = b.scope;
+  meta.group = b.group;
+  return meta;
+}
@@ -1,17 +1,28 @@
 #include "common.h"
+#include "handshake.h"
 #include "macros.h"
+#include "recorder.h"
+#include "routing.h"
 #include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
 #include <fstream>
+#include <linux/input.h>
+#include <mutex>
+#include <optional>
 #include <iostream>
 #include <netinet/in.h>
 #include <openssl/sha.h>
 #include <ostream>
+#include <poll.h>
 #include <signal.h>
 #include <string>
 #include <string_view>
@@ -21,12 +32,63 @@
 #include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <vector>
 using namespace std::chrono_literals;
+namespace chrono = std::chrono;
 
 namespace conn {
+// A connection attempt, handshake included, that takes longer is abandoned.
+constexpr auto connect_timeout = 2s;
+// How long exiting waits for the last scans to go out.
+constexpr auto shutdown_timeout = 2s;
+// At most this many scans are handed to one server at a time; the rest wait
+// in the queue, where a failover can still move them.
+constexpr size_t window = 64;
+// A server that has scans to take but accepts none for this long is dropped
+// and its scans go to the next server on their route.
+constexpr auto stall_timeout = 2s;
+
+struct server {
+  // Only 'up' servers take scans. The sender's poll loop drives the other
+  // states, so a server that stalls never holds up the rest.
+  enum class stage { down, connecting, handshake, up };
+
+  std::string address;
+  uint16_t port;
+  int socket = -1;
+  stage state = stage::down;
+  // When the current connection attempt is abandoned.
+  chrono::steady_clock::time_point deadline = {};
+  // The server's handshake challenge, and how much of it has arrived.
+  uint64_t challenge = 0;
+  size_t challenge_bytes = 0;
+  // A server that just failed isn't tried again before this.
+  chrono::steady_clock::time_point retry_at = {};
+  // Set after a failed attempt, so retries of a down server log once.
+  bool failing = false;
+  // Digests handed to this server but not yet fully written, and how many
+  // bytes of the first one already went out.
+  std::vector<macro> out = {};
+  size_t out_offset = 0;
+  // When 'out' last shrank, or became non-empty.
+  chrono::steady_clock::time_point progress = {};
+
+  std::string name() const { return address + ":" + std::to_string(port); }
+};
+
 std::string address = "127.0.0.1";
 uint16_t port = 6969;
-int socket;
+std::vector<server> servers;
+std::optional<hash_ring> ring;
+
+// Scans waiting for a server, oldest first. Only the sender thread touches
+// the sockets; the scanner thread just queues and wakes it. 'handed' counts
+// the scans in every server's 'out', which count toward the limit too.
+size_t queue_limit = 1024;
+std::mutex mut;
+std::deque<macro> queue;
+size_t handed = 0;
+int wake[2] = {-1, -1};
 }; // namespace conn
 
 namespace app {
@@ -49,7 +111,7 @@ const std::unordered_map<int, char> keymap = {
     {KEY_DOT, '.'},       {KEY_COMMA, ','},       {KEY_SLASH, '/'},
     {KEY_SEMICOLON, ';'}, {KEY_APOSTROPHE, '\''}, {KEY_LEFTBRACE, '['},
     {KEY_RIGHTBRACE, ']'}};
-bool running = true;
+std::atomic_bool running = true;
 
 }; // namespace app
 
@@ -101,6 +163,15 @@ void read_conf() {
   while (f >> var >> value) {
     if (var == "address") {
       conn::address = value;
+    } else if (var == "server") {
+      size_t colon = value.rfind(':');
+      uint16_t port = 0;
+      if (colon == std::string::npos ||
+          !parse_number(std::string_view(value).substr(colon + 1), port)) {
+        std::cerr << "Invalid value for server, expected address:port\n";
+        continue;
+      }
+      conn::servers.push_back({value.substr(0, colon), port});
     } else if (var == "port") {
       try {
         conn::port = static_cast<uint16_t>(std::stoi(value));
@@ -109,97 +180,384 @@ void read_conf() {
       }
     } else if (var == "input_path") {
       app::dev_path = value;
+    } else if (var == "queue_limit") {
+      if (!parse_number(std::string_view(value), conn::queue_limit) ||
+          conn::queue_limit == 0) {
+        std::cerr << "Invalid value for queue_limit\n";
+        conn::queue_limit = 1024;
+      }
     }
   }
 }
 
-bool handshake() {
-  uint32_t initial_value = htonl(0xDEADBEEF);
-  ssize_t sent_bytes =
-      send(conn::socket, &initial_value, sizeof(initial_value), 0);
-  if (sent_bytes < 0) {
-    std::cerr << "Failed to send initial value" << std::endl;
-    return false;
+// Servers listed with 'server' lines, or else the single address/port pair.
+void setup_servers() {
+  if (conn::servers.empty()) {
+    conn::servers.push_back({conn::address, conn::port});
   }
+  std::vector<std::string> names;
+  for (const auto &s : conn::servers) {
+    names.push_back(s.name());
+  }
+  conn::ring.emplace(names);
+}
 
-  uint64_t x;
-  ssize_t received_bytes = recv(conn::socket, &x, sizeof(x), 0);
-  if (received_bytes < 0) {
-    std::cerr << "Failed to receive value from server" << std::endl;
-    return false;
+using stage = conn::server::stage;
+
+// Abandons a connection attempt. The server is left alone for a second.
+void connect_failed(conn::server &s) {
+  if (!s.failing) {
+    std::cerr << "Connection to " << s.name()
+              << " failed, retrying every second" << std::endl;
+  }
+  s.failing = true;
+  if (s.socket >= 0) {
+    close(s.socket);
   }
-  x = ntohll(x);
-  std::cout << "ACK!" << std::endl;
+  s.socket = -1;
+  s.state = stage::down;
+  s.retry_at = chrono::steady_clock::now() + 1s;
+}
 
-  uint64_t result = x;
-  uint64_t n = x % 69;
-  for (uint64_t i = 0; i < n; ++i) {
-    result = hash(result);
+// Starts a non-blocking connection attempt; server_progress takes it
+// through the handshake. Sockets are non-blocking with TCP_NODELAY.
+void server_connect(conn::server &s) {
+  if (!s.failing) {
+    std::cout << "Attempting connection to: " << s.name() << std::endl;
   }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(s.port);
+  s.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (s.socket < 0 ||
+      inet_pton(AF_INET, s.address.c_str(), &addr.sin_addr) <= 0 ||
+      (connect(s.socket, (sockaddr *)&addr, sizeof(addr)) < 0 &&
+       errno != EINPROGRESS)) {
+    connect_failed(s);
+    return;
+  }
+  int one = 1;
+  setsockopt(s.socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  s.state = stage::connecting;
+  s.deadline = chrono::steady_clock::now() + conn::connect_timeout;
+  s.challenge_bytes = 0;
+}
 
-  result = htonll(result);
-  ssize_t sent_hash_bytes = send(conn::socket, &result, sizeof(result), 0);
-  if (sent_hash_bytes < 0) {
-    std::cerr << "Failed to send hashed value back to server" << std::endl;
-    return false;
+// Takes a connection attempt one step further once poll says its socket is
+// ready: from connected to hello sent, and from challenge received to up.
+void server_progress(conn::server &s) {
+  if (s.state == stage::connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    uint32_t hello = handshake_hello();
+    // A fresh socket's send buffer always has room for the hello.
+    if (getsockopt(s.socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err ||
+        send(s.socket, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+      connect_failed(s);
+      return;
+    }
+    s.state = stage::handshake;
+    return;
   }
 
-  std::cout << "Handshake completed successfully." << std::endl;
-  return true;
+  ssize_t n = recv(s.socket, (char *)&s.challenge + s.challenge_bytes,
+                   sizeof(s.challenge) - s.challenge_bytes, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (n <= 0) {
+    connect_failed(s);
+    return;
+  }
+  s.challenge_bytes += n;
+  if (s.challenge_bytes < sizeof(s.challenge)) {
+    return;
+  }
+  uint64_t answer = handshake_answer(s.challenge);
+  if (send(s.socket, &answer, sizeof(answer), MSG_NOSIGNAL) !=
+      sizeof(answer)) {
+    connect_failed(s);
+    return;
+  }
+  s.state = stage::up;
+  s.failing = false;
+  std::cout << "Connected to " << s.name() << std::endl;
 }
 
-void client_connect() {
-  while (app::running) {
-    std::cout << "Attempting connection to: " << conn::address << std::endl;
-    conn::socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (conn::socket < 0) {
-      std::cerr << "Failed to create socket" << std::endl;
+// Puts every digest the server hadn't fully taken back at the front of the
+// queue, so nothing is lost and the order is kept.
+void server_disconnect(conn::server &s) {
+  std::cerr << "Lost connection to " << s.name() << std::endl;
+  close(s.socket);
+  s.socket = -1;
+  s.state = stage::down;
+  s.retry_at = chrono::steady_clock::now() + 1s;
+  if (!s.out.empty()) {
+    std::lock_guard lck(conn::mut);
+    conn::queue.insert(conn::queue.begin(), s.out.begin(), s.out.end());
+    conn::handed -= s.out.size();
+    std::cerr << "Requeued " << s.out.size() << " scans" << std::endl;
+  }
+  s.out.clear();
+  s.out_offset = 0;
+}
+
+// Hands queued scans, in order, to the first live server on each digest's
+// route, up to its window. Scans nobody can take yet stay queued.
+void dispatch() {
+  std::lock_guard lck(conn::mut);
+  while (!conn::queue.empty()) {
+    const macro &m = conn::queue.front();
+    conn::server *target = nullptr;
+    for (size_t i : conn::ring->route(m)) {
+      if (conn::servers[i].state == stage::up) {
+        target = &conn::servers[i];
+        break;
+      }
+    }
+    if (!target || target->out.size() >= conn::window) {
+      return;
+    }
+    if (target->out.empty()) {
+      target->progress = chrono::steady_clock::now();
+    }
+    target->out.push_back(m);
+    conn::queue.pop_front();
+    conn::handed++;
+  }
+}
+
+// Writes as much of the server's backlog as the socket takes without
+// blocking, in as few sends as possible.
+void flush(conn::server &s) {
+  while (!s.out.empty()) {
+    const size_t total = s.out.size() * sizeof(macro);
+    ssize_t n = send(s.socket, (const char *)s.out.data() + s.out_offset,
+                     total - s.out_offset, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        server_disconnect(s);
+      }
       return;
     }
+    s.out_offset += n;
+    size_t done = s.out_offset / sizeof(macro);
+    if (done) {
+      s.out.erase(s.out.begin(), s.out.begin() + done);
+      s.out_offset -= done * sizeof(macro);
+      s.progress = chrono::steady_clock::now();
+      std::lock_guard lck(conn::mut);
+      conn::handed -= done;
+    }
+  }
+}
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(conn::port);
-    if (inet_pton(AF_INET, conn::address.c_str(), &server_addr.sin_addr) <= 0) {
-      std::cerr << "Invalid address" << std::endl;
-      close(conn::socket);
+// Owns every server socket: reconnects dropped servers in the background,
+// drains the queue and waits for the sockets to take more. Nothing here
+// blocks on the network.
+void sender() {
+  // SIGINT has to interrupt the scanner thread's read, so keep it off this
+  // one.
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  while (app::running) {
+    auto now = chrono::steady_clock::now();
+    auto next_retry = now + 1s;
+    for (auto &s : conn::servers) {
+      if (s.state == stage::down && now >= s.retry_at) {
+        server_connect(s);
+      }
+      if (s.state != stage::down && s.state != stage::up &&
+          now >= s.deadline) {
+        connect_failed(s);
+      }
+      if (s.state == stage::up && !s.out.empty() &&
+          now - s.progress >= conn::stall_timeout) {
+        std::cerr << s.name() << " took no scans for "
+                  << chrono::duration_cast<chrono::seconds>(
+                         conn::stall_timeout)
+                         .count()
+                  << " seconds" << std::endl;
+        server_disconnect(s);
+      }
+      if (s.state == stage::down) {
+        next_retry = std::min(next_retry, s.retry_at);
+      } else if (s.state != stage::up) {
+        next_retry = std::min(next_retry, s.deadline);
+      } else if (!s.out.empty()) {
+        next_retry = std::min(next_retry, s.progress + conn::stall_timeout);
+      }
     }
 
-    if (connect(conn::socket, (struct sockaddr *)&server_addr,
-                sizeof(server_addr)) == 0) {
+    dispatch();
+    for (auto &s : conn::servers) {
+      if (s.state == stage::up) {
+        flush(s);
+      }
+    }
 
-      if (!handshake()) {
-        std::cerr << "Connection failed, retrying..." << std::endl;
-        close(conn::socket);
+    std::vector<pollfd> fds = {{conn::wake[0], POLLIN, 0}};
+    std::vector<conn::server *> polled = {nullptr};
+    for (auto &s : conn::servers) {
+      short events;
+      if (s.state == stage::connecting) {
+        events = POLLOUT;
+      } else if (s.state == stage::handshake) {
+        events = POLLIN;
+      } else if (s.state == stage::up) {
+        // The server never sends anything after the handshake, so a
+        // readable socket means it hung up.
+        events = POLLIN | POLLRDHUP;
+        if (!s.out.empty()) {
+          events |= POLLOUT;
+        }
+      } else {
         continue;
       }
+      fds.push_back({s.socket, events, 0});
+      polled.push_back(&s);
+    }
+    auto timeout = chrono::duration_cast<chrono::milliseconds>(
+        next_retry - chrono::steady_clock::now());
+    if (poll(fds.data(), fds.size(),
+             std::max<int64_t>(timeout.count(), 0)) <= 0) {
+      continue;
+    }
 
-      std::cout << "Connected to the server!" << std::endl;
-      break;
-    } else {
-      std::cerr << "Connection failed, retrying..." << std::endl;
-      close(conn::socket);
+    if (fds[0].revents & POLLIN) {
+      char drain[64];
+      while (read(conn::wake[0], drain, sizeof(drain)) > 0) {
+      }
+    }
+    for (size_t i = 1; i < fds.size(); i++) {
+      conn::server &s = *polled[i];
+      if (s.state != stage::up) {
+        if (fds[i].revents) {
+          server_progress(s);
+        }
+      } else if (fds[i].revents & (POLLIN | POLLRDHUP | POLLHUP | POLLERR)) {
+        server_disconnect(s);
+      }
     }
-    std::this_thread::sleep_for(1s);
   }
 }
 
+// Queues a scan for the sender thread. Never blocks on the network; when
+// the queue, counting scans handed to servers, is full the scan is dropped.
 void send_macro(const std::string_view &code) {
   macro hash_value;
   SHA256((const uint8_t *)code.data(), code.size(), (uint8_t *)&hash_value);
+  size_t queued;
+  {
+    std::lock_guard lck(conn::mut);
+    if (conn::queue.size() + conn::handed >= conn::queue_limit) {
+      std::cerr << "Queue full, dropping macro with code: '" << code << "'"
+                << std::endl;
+      return;
+    }
+    conn::queue.push_back(hash_value);
+    queued = conn::queue.size();
+  }
   std::cout << "Sending macro with code: '" << code << "'  (hash '"
-            << hash_value << "') to server" << std::endl;
-  send(conn::socket, &hash_value, sizeof(hash_value), 0);
+            << hash_value << "')";
+  if (queued > 1) {
+    std::cout << ", " << queued << " scans queued";
+  }
+  std::cout << std::endl;
+  char one = 1;
+  (void)!write(conn::wake[1], &one, 1);
+}
+
+// Records a gamepad until SIGINT and writes the result as a macro file.
+int record(const std::string &dev, const std::string &out, uint32_t grid) {
+  int fd = open(dev.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Failed to open device: " << dev << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const uint16_t axes[] = {ABS_X, ABS_Y, ABS_RX, ABS_RY};
+  input_absinfo info[4] = {};
+  for (int a = 0; a < 4; a++) {
+    if (ioctl(fd, EVIOCGABS(axes[a]), &info[a]) < 0 ||
+        info[a].maximum <= info[a].minimum) {
+      info[a].minimum = min_abs;
+      info[a].maximum = max_abs;
+    }
+  }
+  auto normalize = [&](int a, int32_t v) {
+    return 2.0f * (v - info[a].minimum) / (info[a].maximum - info[a].minimum) -
+           1.0f;
+  };
+
+  std::cout << "Recording " << dev << ", press Ctrl+C to stop." << std::endl;
+  recorder rec;
+  float axis[4] = {0, 0, 0, 0};
+  bool moved = false;
+  std::optional<timeval> start;
+  input_event ev;
+  while (app::running && read(fd, &ev, sizeof(ev)) == sizeof(ev)) {
+    if (!start) {
+      start = ev.time;
+    }
+    uint32_t t = (ev.time.tv_sec - start->tv_sec) * 1000 +
+                 (ev.time.tv_usec - start->tv_usec) / 1000;
+
+    if (ev.type == EV_KEY && ev.value != 2 &&
+        profiles[gamepad_profile].key_name(ev.code) != "?") {
+      rec.key(t, ev.code, ev.value == 1);
+    } else if (ev.type == EV_ABS) {
+      for (int a = 0; a < 4; a++) {
+        if (ev.code == axes[a]) {
+          axis[a] = normalize(a, ev.value);
+          moved = true;
+        }
+      }
+    } else if (ev.type == EV_SYN && ev.code == SYN_REPORT && moved) {
+      rec.stick(t, side::left, axis[0], axis[1]);
+      rec.stick(t, side::right, axis[2], axis[3]);
+      moved = false;
+    }
+  }
+  close(fd);
+
+  std::ofstream f(out);
+  if (!f.is_open()) {
+    std::cerr << "Failed to open output file: " << out << std::endl;
+    return EXIT_FAILURE;
+  }
+  f << rec.finish(grid);
+  std::cout << "\nWrote " << rec.events.size() << " events to " << out
+            << std::endl;
+  return EXIT_SUCCESS;
 }
 
 void sigint(int) { app::running = false; }
-int main(void) {
+int main(int argc, char **argv) {
   struct sigaction sa;
   sa.sa_handler = sigint;
   sigemptyset(&sa.sa_mask);
   sa.sa_flags = 0;
   sigaction(SIGINT, &sa, nullptr);
 
+  if (argc > 1 && std::string_view(argv[1]) == "record") {
+    if (argc < 4) {
+      std::cerr << "Usage: " << argv[0]
+                << " record <gamepad event device> <output file> [grid ms]"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    uint32_t grid = 10;
+    if (argc > 4 && !parse_number(std::string_view(argv[4]), grid)) {
+      std::cerr << "Invalid grid: " << argv[4] << std::endl;
+      return EXIT_FAILURE;
+    }
+    return record(argv[2], argv[3], grid);
+  }
+
   termios term_info, save;
   if (tcgetattr(STDIN_FILENO, &term_info) < 0) {
     std::cerr << "Tcgetattr failed." << std::endl;
@@ -214,21 +572,60 @@ int main(void) {
   }
 
   read_conf();
+  setup_servers();
 
   // HACK: this is terrible
   std::string input = "";
   if (!setup_dev()) {
     goto end;
   }
-  client_connect();
+  if (pipe2(conn::wake, O_NONBLOCK) < 0) {
+    std::cerr << "Failed to create wake pipe" << std::endl;
+    goto end;
+  }
+  {
+    std::thread send_thread(sender);
 
-  std::cout << "Awaiting input..." << std::endl;
-  while (app::running) {
-    input = read_str();
-    send_macro(input);
+    std::cout << "Awaiting input..." << std::endl;
+    while (app::running) {
+      input = read_str();
+      if (app::running) {
+        send_macro(input);
+      }
+    }
+
+    char one = 1;
+    (void)!write(conn::wake[1], &one, 1);
+    send_thread.join();
   }
 
-  close(conn::socket);
+  // One last try so a scan made just before exiting isn't lost, bounded so
+  // a stalled server can't hold up the exit.
+  dispatch();
+  {
+    const auto deadline = chrono::steady_clock::now() + conn::shutdown_timeout;
+    size_t unsent = 0;
+    for (auto &s : conn::servers) {
+      while (s.state == stage::up && !s.out.empty()) {
+        flush(s);
+        auto left = chrono::duration_cast<chrono::milliseconds>(
+            deadline - chrono::steady_clock::now());
+        if (s.state != stage::up || s.out.empty() || left <= 0ms) {
+          break;
+        }
+        pollfd p = {s.socket, POLLOUT, 0};
+        poll(&p, 1, left.count());
+      }
+      unsent += s.out.size();
+      if (s.socket >= 0) {
+        close(s.socket);
+      }
+    }
+    unsent += conn::queue.size();
+    if (unsent) {
+      std::cerr << "Exiting with " << unsent << " unsent scans" << std::endl;
+    }
+  }
 
 end:
   if (tcsetattr(STDIN_FILENO, TCSANOW, &save) < 0) {
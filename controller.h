@@ -1,5 +1,8 @@
 #pragma once
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <fcntl.h>
@@ -8,11 +11,14 @@
 #include <linux/input-event-codes.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
+#include <mutex>
+#include <optional>
 #include <ostream>
-#include <string>
+#include <span>
+#include <string_view>
 #include <sys/ioctl.h>
+#include <thread>
 #include <unistd.h>
-#include <unordered_map>
 #include <utility>
 
 using controller = int;
@@ -21,6 +27,8 @@ using controller = int;
 constexpr auto max_abs = std::numeric_limits<int16_t>::max();
 constexpr auto min_abs = std::numeric_limits<int16_t>::min();
 
+inline std::atomic<uint64_t> write_errors = 0;
+
 inline void setup_abs(int fd, uint16_t chan) {
   if (ioctl(fd, UI_SET_ABSBIT, chan)) {
     std::cerr << "Failed to set abs bit" << std::endl;
@@ -36,62 +44,252 @@ inline void setup_abs(int fd, uint16_t chan) {
   }
 }
 
-inline controller controller_init() {
-  int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+// One name a macro can use for a key, and the event code it sends.
+struct key_def {
+  std::string_view name;
+  uint16_t code;
+};
+
+// One ioctl of a device's uinput setup. UI_ABS_SETUP steps are done by
+// setup_abs, which also sets the axis bit.
+struct setup_step {
+  unsigned long request;
+  uint16_t arg;
+};
+
+// X and Y axis of a stick, or no_axis for a stick the device doesn't have.
+using stick_axes = std::array<uint16_t, 2>;
+constexpr uint16_t no_axis = ABS_CNT;
+
+// Everything derived from a profile's key and stick list, computed at
+// compile time: keys sorted by name and by code for binary search, and the
+// uinput setup sequence.
+template <size_t Keys, size_t Sticks>
+struct profile_tables {
+  std::array<key_def, Keys> by_name;
+  std::array<key_def, Keys> by_code;
+  std::array<setup_step, Keys + 2 * Sticks + (Sticks ? 2 : 1)> setup;
+  std::array<stick_axes, 2> sticks;
+};
+
+template <size_t Keys, size_t Sticks>
+constexpr profile_tables<Keys, Sticks>
+make_profile_tables(const std::array<key_def, Keys> &keys,
+                    const std::array<stick_axes, Sticks> &sticks) {
+  static_assert(Sticks <= 2, "a profile has at most a left and right stick");
+  profile_tables<Keys, Sticks> t{keys, keys, {}, {}};
+  std::sort(t.by_name.begin(), t.by_name.end(),
+            [](const key_def &a, const key_def &b) { return a.name < b.name; });
+  std::sort(t.by_code.begin(), t.by_code.end(),
+            [](const key_def &a, const key_def &b) { return a.code < b.code; });
+
+  size_t n = 0;
+  t.setup[n++] = {UI_SET_EVBIT, EV_KEY};
+  for (const auto &k : keys) {
+    t.setup[n++] = {UI_SET_KEYBIT, k.code};
+  }
+  if (Sticks) {
+    t.setup[n++] = {UI_SET_EVBIT, EV_ABS};
+  }
+  t.sticks.fill({no_axis, no_axis});
+  for (size_t s = 0; s < Sticks; s++) {
+    t.sticks[s] = sticks[s];
+    t.setup[n++] = {UI_ABS_SETUP, sticks[s][0]};
+    t.setup[n++] = {UI_ABS_SETUP, sticks[s][1]};
+  }
+  return t;
+}
 
-  if (fd < 0) {
-    std::cerr << "Failed to open /dev/uinput" << std::endl;
-    return -1;
+// No two keys of a profile may share a name or a code.
+template <size_t Keys, size_t Sticks>
+constexpr bool keys_unique(const profile_tables<Keys, Sticks> &t) {
+  for (size_t i = 1; i < Keys; i++) {
+    if (t.by_name[i - 1].name == t.by_name[i].name ||
+        t.by_code[i - 1].code == t.by_code[i].code) {
+      return false;
+    }
   }
+  return true;
+}
 
-  ioctl(fd, UI_SET_EVBIT, EV_KEY);
+inline constexpr auto gamepad_tables = make_profile_tables(
+    std::to_array<key_def>({{"0", BTN_0},
+                            {"1", BTN_1},
+                            {"2", BTN_2},
+                            {"3", BTN_3},
+                            {"4", BTN_4},
+                            {"5", BTN_5},
+                            {"6", BTN_6},
+                            {"7", BTN_7},
+                            {"8", BTN_8},
+                            {"9", BTN_9},
+
+                            {"A", BTN_A},
+                            {"B", BTN_B},
+                            {"X", BTN_X},
+                            {"Y", BTN_Y},
+
+                            {"TL", BTN_TL},
+                            {"TR", BTN_TR},
+                            {"TL2", BTN_TL2},
+                            {"TR2", BTN_TR2},
+
+                            {"START", BTN_START},
+                            {"SELECT", BTN_SELECT},
+
+                            {"THUMBL", BTN_THUMBL},
+                            {"THUMBR", BTN_THUMBR},
+
+                            {"DPAD_UP", BTN_DPAD_UP},
+                            {"DPAD_DOWN", BTN_DPAD_DOWN},
+                            {"DPAD_LEFT", BTN_DPAD_LEFT},
+                            {"DPAD_RIGHT", BTN_DPAD_RIGHT}}),
+    std::to_array<stick_axes>({{ABS_X, ABS_Y}, {ABS_RX, ABS_RY}}));
+static_assert(keys_unique(gamepad_tables));
+
+// A keyboard with mouse buttons. Its one stick places the pointer anywhere
+// on screen, like a tablet.
+inline constexpr auto keyboard_tables = make_profile_tables(
+    std::to_array<key_def>(
+        {{"A", KEY_A},                 {"B", KEY_B},
+         {"C", KEY_C},                 {"D", KEY_D},
+         {"E", KEY_E},                 {"F", KEY_F},
+         {"G", KEY_G},                 {"H", KEY_H},
+         {"I", KEY_I},                 {"J", KEY_J},
+         {"K", KEY_K},                 {"L", KEY_L},
+         {"M", KEY_M},                 {"N", KEY_N},
+         {"O", KEY_O},                 {"P", KEY_P},
+         {"Q", KEY_Q},                 {"R", KEY_R},
+         {"S", KEY_S},                 {"T", KEY_T},
+         {"U", KEY_U},                 {"V", KEY_V},
+         {"W", KEY_W},                 {"X", KEY_X},
+         {"Y", KEY_Y},                 {"Z", KEY_Z},
+         {"0", KEY_0},                 {"1", KEY_1},
+         {"2", KEY_2},                 {"3", KEY_3},
+         {"4", KEY_4},                 {"5", KEY_5},
+         {"6", KEY_6},                 {"7", KEY_7},
+         {"8", KEY_8},                 {"9", KEY_9},
+         {"F1", KEY_F1},               {"F2", KEY_F2},
+         {"F3", KEY_F3},               {"F4", KEY_F4},
+         {"F5", KEY_F5},               {"F6", KEY_F6},
+         {"F7", KEY_F7},               {"F8", KEY_F8},
+         {"F9", KEY_F9},               {"F10", KEY_F10},
+         {"F11", KEY_F11},             {"F12", KEY_F12},
+         {"ESC", KEY_ESC},             {"TAB", KEY_TAB},
+         {"ENTER", KEY_ENTER},         {"SPACE", KEY_SPACE},
+         {"BACKSPACE", KEY_BACKSPACE}, {"SHIFT", KEY_LEFTSHIFT},
+         {"CTRL", KEY_LEFTCTRL},       {"ALT", KEY_LEFTALT},
+         {"UP", KEY_UP},               {"DOWN", KEY_DOWN},
+         {"LEFT", KEY_LEFT},           {"RIGHT", KEY_RIGHT},
+         {"MOUSE_LEFT", BTN_LEFT},     {"MOUSE_RIGHT", BTN_RIGHT},
+         {"MOUSE_MIDDLE", BTN_MIDDLE}}),
+    std::to_array<stick_axes>({{ABS_X, ABS_Y}}));
+static_assert(keys_unique(keyboard_tables));
+
+// An arcade cabinet with two joysticks, six buttons a side and coin/start.
+inline constexpr auto arcade_tables = make_profile_tables(
+    std::to_array<key_def>({{"A", BTN_A},
+                            {"B", BTN_B},
+                            {"C", BTN_C},
+                            {"X", BTN_X},
+                            {"Y", BTN_Y},
+                            {"Z", BTN_Z},
+                            {"TL", BTN_TL},
+                            {"TR", BTN_TR},
+                            {"COIN", BTN_SELECT},
+                            {"START", BTN_START},
+                            {"MODE", BTN_MODE}}),
+    std::to_array<stick_axes>({{ABS_X, ABS_Y}, {ABS_RX, ABS_RY}}));
+static_assert(keys_unique(arcade_tables));
+
+// A virtual device layout a macro can be written for. Lookups are binary
+// searches over the compile-time tables, so resolving a key never hashes.
+struct controller_profile {
+  std::string_view name;
+  const char *device_name;
+  uint16_t product;
+  std::span<const key_def> by_name;
+  std::span<const key_def> by_code;
+  std::span<const setup_step> setup;
+  std::array<stick_axes, 2> sticks;
+
+  template <size_t Keys, size_t Sticks>
+  constexpr controller_profile(std::string_view name, const char *device_name,
+                               uint16_t product,
+                               const profile_tables<Keys, Sticks> &t)
+      : name(name), device_name(device_name), product(product),
+        by_name(t.by_name), by_code(t.by_code), setup(t.setup),
+        sticks(t.sticks) {}
+
+  constexpr std::optional<uint16_t> find_key(std::string_view key) const {
+    auto it = std::lower_bound(
+        by_name.begin(), by_name.end(), key,
+        [](const key_def &k, std::string_view n) { return k.name < n; });
+    if (it == by_name.end() || it->name != key) {
+      return {};
+    }
+    return it->code;
+  }
 
-  ioctl(fd, UI_SET_KEYBIT, BTN_0);
-  ioctl(fd, UI_SET_KEYBIT, BTN_1);
-  ioctl(fd, UI_SET_KEYBIT, BTN_2);
-  ioctl(fd, UI_SET_KEYBIT, BTN_3);
-  ioctl(fd, UI_SET_KEYBIT, BTN_4);
-  ioctl(fd, UI_SET_KEYBIT, BTN_5);
-  ioctl(fd, UI_SET_KEYBIT, BTN_6);
-  ioctl(fd, UI_SET_KEYBIT, BTN_7);
-  ioctl(fd, UI_SET_KEYBIT, BTN_8);
-  ioctl(fd, UI_SET_KEYBIT, BTN_9);
+  constexpr std::string_view key_name(uint16_t code) const {
+    auto it = std::lower_bound(
+        by_code.begin(), by_code.end(), code,
+        [](const key_def &k, uint16_t c) { return k.code < c; });
+    if (it == by_code.end() || it->code != code) {
+      return "?";
+    }
+    return it->name;
+  }
 
-  ioctl(fd, UI_SET_KEYBIT, BTN_A);
-  ioctl(fd, UI_SET_KEYBIT, BTN_B);
-  ioctl(fd, UI_SET_KEYBIT, BTN_X);
-  ioctl(fd, UI_SET_KEYBIT, BTN_Y);
+  constexpr bool has_stick(side s) const {
+    return sticks[(size_t)s][0] != no_axis;
+  }
+};
 
-  ioctl(fd, UI_SET_KEYBIT, BTN_TL);
-  ioctl(fd, UI_SET_KEYBIT, BTN_TR);
-  ioctl(fd, UI_SET_KEYBIT, BTN_TL2);
-  ioctl(fd, UI_SET_KEYBIT, BTN_TR2);
+inline constexpr std::array<controller_profile, 3> profiles = {{
+    {"gamepad", "Barcode controller", 0x3, gamepad_tables},
+    {"keyboard", "Barcode keyboard", 0x4, keyboard_tables},
+    {"arcade", "Barcode arcade stick", 0x5, arcade_tables},
+}};
 
-  ioctl(fd, UI_SET_KEYBIT, BTN_START);
-  ioctl(fd, UI_SET_KEYBIT, BTN_SELECT);
+// Index of the profile macros use unless they pick another.
+constexpr uint8_t gamepad_profile = 0;
 
-  ioctl(fd, UI_SET_KEYBIT, BTN_THUMBL);
-  ioctl(fd, UI_SET_KEYBIT, BTN_THUMBR);
+static_assert(profiles[gamepad_profile].find_key("DPAD_UP") == BTN_DPAD_UP);
+static_assert(profiles[gamepad_profile].key_name(BTN_START) == "START");
 
-  ioctl(fd, UI_SET_KEYBIT, BTN_DPAD_UP);
-  ioctl(fd, UI_SET_KEYBIT, BTN_DPAD_DOWN);
-  ioctl(fd, UI_SET_KEYBIT, BTN_DPAD_LEFT);
-  ioctl(fd, UI_SET_KEYBIT, BTN_DPAD_RIGHT);
+constexpr std::optional<uint8_t> find_profile(std::string_view name) {
+  for (size_t p = 0; p < profiles.size(); p++) {
+    if (profiles[p].name == name) {
+      return p;
+    }
+  }
+  return {};
+}
 
-  ioctl(fd, UI_SET_EVBIT, EV_ABS);
+inline controller controller_init(const controller_profile &profile) {
+  int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
 
-  setup_abs(fd, ABS_X);
-  setup_abs(fd, ABS_Y);
+  if (fd < 0) {
+    std::cerr << "Failed to open /dev/uinput" << std::endl;
+    return -1;
+  }
 
-  setup_abs(fd, ABS_RX);
-  setup_abs(fd, ABS_RY);
+  for (const auto &step : profile.setup) {
+    if (step.request == UI_ABS_SETUP) {
+      setup_abs(fd, step.arg);
+    } else if (ioctl(fd, step.request, step.arg)) {
+      std::cerr << "Failed to set up " << profile.name << " bit " << step.arg
+                << std::endl;
+    }
+  }
 
   uinput_setup setup{};
-  strcpy(setup.name, "Barcode controller");
+  strcpy(setup.name, profile.device_name);
   setup.id = {
       .bustype = BUS_USB,
       .vendor = 0x3,
-      .product = 0x3,
+      .product = profile.product,
       .version = 2,
   };
 
@@ -108,6 +306,11 @@ inline controller controller_init() {
   return fd;
 }
 
+// A controller whose events go nowhere, for running without /dev/uinput.
+inline controller null_controller_init() {
+  return open("/dev/null", O_WRONLY);
+}
+
 inline void destroy_controller(controller c) {
   if (ioctl(c, UI_DEV_DESTROY)) {
 
@@ -125,6 +328,7 @@ inline void send_event(controller c, uint16_t type, uint16_t code,
   ev.value = value;
 
   if (write(c, &ev, sizeof(ev)) != sizeof(ev)) {
+    write_errors++;
     std::cerr << "Failed to send event to controller" << std::endl;
   }
 }
@@ -137,19 +341,11 @@ inline int16_t map_controller_range(float v) {
 
 inline void sync(controller c) { send_event(c, EV_SYN, SYN_REPORT, 0); }
 
-template <side S>
-inline void set_joystick(controller c, std::pair<float, float> coords);
-template <>
-inline void set_joystick<side::left>(controller c,
-                                     std::pair<float, float> coords) {
-  send_event(c, EV_ABS, ABS_X, map_controller_range(coords.first));
-  send_event(c, EV_ABS, ABS_Y, map_controller_range(coords.second));
-}
-template <>
-inline void set_joystick<side::right>(controller c,
-                                      std::pair<float, float> coords) {
-  send_event(c, EV_ABS, ABS_RX, map_controller_range(coords.first));
-  send_event(c, EV_ABS, ABS_RY, map_controller_range(coords.second));
+inline void set_joystick(controller c, const controller_profile &profile,
+                         side s, std::pair<float, float> coords) {
+  const stick_axes &axes = profile.sticks[(size_t)s];
+  send_event(c, EV_ABS, axes[0], map_controller_range(coords.first));
+  send_event(c, EV_ABS, axes[1], map_controller_range(coords.second));
 }
 
 inline void press_button(controller c, uint16_t button) {
@@ -160,35 +356,82 @@ inline void release_button(controller c, uint16_t button) {
   send_event(c, EV_KEY, button, 0);
 }
 
-const std::unordered_map<std::string, uint16_t> keycode_map = {
-    {"0", BTN_0},
-    {"1", BTN_1},
-    {"2", BTN_2},
-    {"3", BTN_3},
-    {"4", BTN_4},
-    {"5", BTN_5},
-    {"6", BTN_6},
-    {"7", BTN_7},
-    {"8", BTN_8},
-    {"9", BTN_9},
-
-    {"A", BTN_A},
-    {"B", BTN_B},
-    {"X", BTN_X},
-    {"Y", BTN_Y},
-
-    {"TL", BTN_TL},
-    {"TR", BTN_TR},
-    {"TL2", BTN_TL2},
-    {"TR2", BTN_TR2},
-
-    {"START", BTN_START},
-    {"SELECT", BTN_SELECT},
-
-    {"THUMBL", BTN_THUMBL},
-    {"THUMBR", BTN_THUMBR},
-
-    {"DPAD_UP", BTN_DPAD_UP},
-    {"DPAD_DOWN", BTN_DPAD_DOWN},
-    {"DPAD_LEFT", BTN_DPAD_LEFT},
-    {"DPAD_RIGHT", BTN_DPAD_RIGHT}};
+// A client's virtual devices, one per profile. The server creates the ones
+// its macros use ahead of time with create(); any other is made on first
+// use. With 'null' set they all write to /dev/null instead.
+struct controller_set {
+  // How long a new uinput device is given for udev and the game to pick it
+  // up; events sent before that are lost.
+  static constexpr std::chrono::milliseconds settle{200};
+
+  bool null = false;
+  std::mutex mut;
+  std::array<std::atomic<controller>, profiles.size()> devices;
+
+  explicit controller_set(bool null) : null(null) {
+    for (auto &d : devices) {
+      d = -1;
+    }
+  }
+  controller_set(const controller_set &) = delete;
+  controller_set &operator=(const controller_set &) = delete;
+
+  ~controller_set() {
+    for (auto &d : devices) {
+      if (d < 0) {
+        continue;
+      }
+      if (null) {
+        close(d);
+      } else {
+        destroy_controller(d);
+      }
+    }
+  }
+
+  controller get(uint8_t profile) {
+    controller c = devices[profile].load(std::memory_order_acquire);
+    if (c >= 0) {
+      return c;
+    }
+    create(1u << profile);
+    return devices[profile];
+  }
+
+  // Creates the missing devices of the profiles in 'mask' (bit n for
+  // profile n) and waits for them to settle before anyone can use them.
+  void create(uint32_t mask) {
+    std::lock_guard lck(mut);
+    std::array<controller, profiles.size()> fresh;
+    bool created = false;
+    for (size_t p = 0; p < profiles.size(); p++) {
+      fresh[p] = -1;
+      if ((mask >> p & 1) && devices[p] < 0) {
+        fresh[p] = null ? null_controller_init() : controller_init(profiles[p]);
+        created = true;
+      }
+    }
+    if (created && !null) {
+      std::this_thread::sleep_for(settle);
+    }
+    for (size_t p = 0; p < profiles.size(); p++) {
+      if (fresh[p] >= 0) {
+        devices[p].store(fresh[p], std::memory_order_release);
+      }
+    }
+  }
+
+  // Releases every key of every device created so far.
+  void release_all() {
+    for (size_t p = 0; p < profiles.size(); p++) {
+      controller c = devices[p];
+      if (c < 0) {
+        continue;
+      }
+      for (const auto &k : profiles[p].by_code) {
+        release_button(c, k.code);
+      }
+      sync(c);
+    }
+  }
+};
@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Fixed-capacity array whose chunks are allocated on first touch, so it can
+// grow while other threads index into it without any locking.
+template <typename T, size_t ChunkSize = 256, size_t MaxChunks = 4096>
+struct chunked_array {
+  static constexpr size_t capacity = ChunkSize * MaxChunks;
+
+  std::array<std::atomic<T *>, MaxChunks> chunks{};
+
+  chunked_array() = default;
+  chunked_array(const chunked_array &) = delete;
+  chunked_array &operator=(const chunked_array &) = delete;
+
+  ~chunked_array() {
+    for (auto &chunk : chunks) {
+      delete[] chunk.load();
+    }
+  }
+
+  T &operator[](size_t i) { return chunk(i / ChunkSize)[i % ChunkSize]; }
+
+  // Allocates every chunk below index 'n' now, so indexing them later never
+  // allocates.
+  void reserve(size_t n) {
+    for (size_t c = 0; c < std::min((n + ChunkSize - 1) / ChunkSize, MaxChunks);
+         c++) {
+      chunk(c);
+    }
+  }
+
+private:
+  T *chunk(size_t c) {
+    auto &slot = chunks[c];
+    T *chunk = slot.load(std::memory_order_acquire);
+    if (!chunk) {
+      T *fresh = new T[ChunkSize]();
+      if (slot.compare_exchange_strong(chunk, fresh,
+                                       std::memory_order_acq_rel)) {
+        chunk = fresh;
+      } else {
+        delete[] fresh;
+      }
+    }
+    return chunk;
+  }
+};
+
+// How a macro's cooldown behaves. Fixed when the macro is compiled.
+struct cooldown_spec {
+  uint32_t base_ms;
+  uint32_t increment_ms;
+  uint32_t max_ms;
+  // Slot holding the cooldown state: the macro's own id, or its group's.
+  uint32_t slot;
+  bool global;
+};
+
+// Cooldown state for every slot in one scope (one client, or global). Each
+// slot packs the start of the current cooldown, in ms since process start,
+// into the upper 40 bits and its length in ms into the lower 24 bits, so
+// one CAS updates both. Lengths are capped at ~4.6 hours.
+using cooldown_table = chunked_array<std::atomic<uint64_t>>;
+
+constexpr uint64_t cooldown_len_bits = 24;
+constexpr uint64_t cooldown_len_mask = (1ull << cooldown_len_bits) - 1;
+
+inline uint64_t cooldown_now_ms() {
+  static const auto epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - epoch)
+      .count();
+}
+
+// Returns true if the request may play. A request during the cooldown
+// extends it by 'increment' (capped at 'max') and is rejected; otherwise the
+// cooldown restarts at 'base'. Callers read 'now' before racing each other
+// here, so another request may already have started a cooldown later than
+// 'now'; that one counts as still cooling down.
+inline bool cooldown_try(std::atomic<uint64_t> &state, uint32_t base,
+                         uint32_t increment, uint32_t max, uint64_t now) {
+  uint64_t old = state.load(std::memory_order_relaxed);
+  while (true) {
+    uint64_t start = old >> cooldown_len_bits;
+    uint64_t length = old & cooldown_len_mask;
+
+    bool allowed = length == 0 || (now >= start && now - start >= length);
+    uint64_t next = allowed ? (now << cooldown_len_bits) |
+                                  std::min<uint64_t>(base, cooldown_len_mask)
+                            : (start << cooldown_len_bits) |
+                                  std::min<uint64_t>(
+                                      std::min<uint64_t>(length + increment,
+                                                         max),
+                                      cooldown_len_mask);
+    if (state.compare_exchange_weak(old, next, std::memory_order_relaxed)) {
+      return allowed;
+    }
+  }
+}
@@ -0,0 +1,69 @@
+#include "cooldown.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+// Regression checks for the lock-free cooldown. Run with 'make test'.
+
+int failures = 0;
+
+void expect(bool ok, const char *what) {
+  if (!ok) {
+    std::cerr << "FAIL: " << what << std::endl;
+    failures++;
+  }
+}
+
+int main() {
+  {
+    std::atomic<uint64_t> state = 0;
+    expect(cooldown_try(state, 500, 1000, 3000, 1000), "first request plays");
+    expect(!cooldown_try(state, 500, 1000, 3000, 1200),
+           "request inside the cooldown is rejected");
+    expect(cooldown_try(state, 500, 1000, 3000, 10000),
+           "request after the cooldown plays");
+  }
+  {
+    // Two requests read the clock a millisecond apart and reach the CAS in
+    // the opposite order: the later start is already stored when the
+    // earlier 'now' is checked.
+    std::atomic<uint64_t> state = 0;
+    expect(cooldown_try(state, 500, 1000, 3000, 1000), "now=1000 plays");
+    expect(!cooldown_try(state, 500, 1000, 3000, 999),
+           "now=999 after a cooldown started at 1000 is rejected");
+  }
+  {
+    std::atomic<uint64_t> state = 0;
+    expect(cooldown_try(state, 0, 0, 0, 1000), "no cooldown plays");
+    expect(cooldown_try(state, 0, 0, 0, 999),
+           "no cooldown plays with an older timestamp");
+  }
+  {
+    // Many threads racing on one slot with timestamps around the same
+    // instant: exactly one may play.
+    std::atomic<uint64_t> state = 0;
+    std::atomic<int> allowed = 0;
+    std::atomic<bool> go = false;
+    std::thread threads[8];
+    for (int t = 0; t < 8; t++) {
+      threads[t] = std::thread([&, t] {
+        while (!go) {
+        }
+        allowed += cooldown_try(state, 500, 1000, 3000, 5000 + (t % 3));
+      });
+    }
+    go = true;
+    for (auto &t : threads) {
+      t.join();
+    }
+    expect(allowed == 1, "exactly one of several racing requests plays");
+  }
+
+  if (failures) {
+    return EXIT_FAILURE;
+  }
+  std::cout << "cooldown: all checks passed" << std::endl;
+  return EXIT_SUCCESS;
+}
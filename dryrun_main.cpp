@@ -0,0 +1,285 @@
+#include "macros.h"
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Plays every macro in a directory on a virtual clock, without sleeping or
+// touching a controller, and reports how long each one takes, how many
+// controller events it writes and how many buttons it holds at once. Every
+// combination of 'play' choices is followed, so the numbers are bounds over
+// all runs. Exits non-zero if any macro fails to compile or plays a macro
+// that doesn't exist, so it can gate CI.
+
+namespace fs = std::filesystem;
+
+// Paths followed per macro before giving up on exact bounds.
+constexpr size_t max_paths = 4096;
+// 'play' nesting deeper than this is taken to be endless recursion.
+constexpr size_t max_play_depth = 64;
+
+struct loaded_macro {
+  std::string name;
+  macro_sequence seq;
+};
+
+namespace app {
+std::map<macro, loaded_macro> macros;
+}; // namespace app
+
+struct frame {
+  const macro_sequence *seq;
+  size_t pc = 0;
+  struct loop_frame {
+    size_t begin;
+    uint32_t left;
+    // vm.ms when the loop started.
+    uint64_t mark;
+  };
+  std::array<loop_frame, max_loop_depth> loops = {};
+  size_t depth = 0;
+};
+
+// Where one path through a macro has got to.
+struct machine {
+  std::vector<frame> stack;
+  uint64_t ms = 0;
+  uint64_t events = 0;
+  std::bitset<KEY_CNT> held;
+  size_t max_held = 0;
+  bool endless = false;
+};
+
+struct report {
+  uint64_t min_ms = UINT64_MAX, max_ms = 0;
+  uint64_t min_events = UINT64_MAX, max_events = 0;
+  size_t max_held = 0;
+  size_t paths = 0;
+  bool truncated = false;
+  bool endless = false;
+  std::set<std::string> errors;
+};
+
+void finish_path(const machine &vm, report &r) {
+  r.min_ms = std::min(r.min_ms, vm.ms);
+  r.max_ms = std::max(r.max_ms, vm.ms);
+  r.min_events = std::min(r.min_events, vm.events);
+  r.max_events = std::max(r.max_events, vm.events);
+  r.max_held = std::max(r.max_held, vm.max_held);
+  r.endless = r.endless || vm.endless;
+  r.paths++;
+}
+
+// Runs 'vm' until it finishes or reaches a 'play', which forks it once per
+// target onto 'pending'.
+void run(machine vm, std::vector<machine> &pending, report &r) {
+  while (!vm.stack.empty()) {
+    frame &f = vm.stack.back();
+    if (f.pc >= f.seq->code.size()) {
+      vm.stack.pop_back();
+      continue;
+    }
+    const instr &i = f.seq->code[f.pc++];
+    const auto &keys = profiles[f.seq->profile].by_code;
+    switch (i.code) {
+    case op::press:
+      vm.held.set(i.key);
+      vm.max_held = std::max(vm.max_held, vm.held.count());
+      vm.events++;
+      break;
+    case op::release:
+      vm.held.reset(i.key);
+      vm.events++;
+      break;
+    case op::press_all:
+      for (const auto &[k, code] : keys) {
+        vm.held.set(code);
+      }
+      vm.max_held = std::max(vm.max_held, vm.held.count());
+      vm.events += keys.size();
+      break;
+    case op::release_all:
+      for (const auto &[k, code] : keys) {
+        vm.held.reset(code);
+      }
+      vm.events += keys.size();
+      break;
+    case op::wait:
+      vm.ms += i.arg;
+      vm.events++;
+      break;
+    case op::joy_l:
+    case op::joy_r:
+      vm.events += 2;
+      break;
+    case op::ramp_l:
+    case op::ramp_r:
+      vm.ms += i.arg;
+      // Two axis writes and a sync per step, as play_sequence does.
+      vm.events += 3 * std::max<uint32_t>(1, i.arg / ramp_step.count());
+      break;
+    case op::sync:
+      vm.events++;
+      break;
+    case op::loop_begin: {
+      uint32_t count = f.seq->code[i.arg].arg;
+      if (count == 0) {
+        f.pc = i.arg + 1;
+      } else {
+        f.loops[f.depth++] = {f.pc - 1, count, vm.ms};
+      }
+      break;
+    }
+    case op::loop_end: {
+      auto &loop = f.loops[f.depth - 1];
+      if (i.arg == repeat_forever) {
+        // Counted once; the report says it runs until cancelled. Playback
+        // stops a loop whose iteration takes no time.
+        if (vm.ms == loop.mark) {
+          r.errors.insert("'repeat until-cancel' takes no time on some path, "
+                          "so playback would stop it");
+        }
+        vm.endless = true;
+        f.depth--;
+      } else if (--loop.left == 0) {
+        f.depth--;
+      } else {
+        f.pc = loop.begin + 1;
+      }
+      break;
+    }
+    case op::play: {
+      if (vm.stack.size() > max_play_depth) {
+        r.errors.insert("'play' nests more than " +
+                        std::to_string(max_play_depth) +
+                        " deep, probably recursion");
+        break;
+      }
+      const play_table &table = f.seq->plays[i.arg];
+      std::set<macro> seen;
+      for (size_t t = 0; t < table.targets.size(); t++) {
+        if (!seen.insert(table.targets[t]).second) {
+          continue;
+        }
+        auto it = app::macros.find(table.targets[t]);
+        if (it == app::macros.end()) {
+          r.errors.insert("plays undefined macro '" + table.names[t] + "'");
+          pending.push_back(vm);
+          continue;
+        }
+        machine fork = vm;
+        fork.stack.push_back({&it->second.seq});
+        pending.push_back(std::move(fork));
+      }
+      return;
+    }
+    }
+  }
+  finish_path(vm, r);
+}
+
+report analyze(const macro_sequence &seq) {
+  report r;
+  std::vector<machine> pending;
+  machine start;
+  start.stack.push_back({&seq});
+  pending.push_back(std::move(start));
+  while (!pending.empty()) {
+    if (r.paths >= max_paths) {
+      r.truncated = true;
+      break;
+    }
+    machine vm = std::move(pending.back());
+    pending.pop_back();
+    run(std::move(vm), pending, r);
+  }
+  return r;
+}
+
+int main(int argc, char **argv) {
+  const fs::path macro_dir = argc > 1 ? argv[1] : "macros";
+  if (!fs::is_directory(macro_dir)) {
+    std::cerr << "Error: Macro directory '" << macro_dir
+              << "' does not exist or is not a directory.\n";
+    return EXIT_FAILURE;
+  }
+
+  bool failed = false;
+  std::map<std::string, fs::path> files;
+  for (const auto &entry : fs::directory_iterator(macro_dir)) {
+    if (!entry.is_regular_file()) {
+      continue;
+    }
+    const std::string name = entry.path().filename().string();
+    auto built = build_macro(entry.path());
+    if (!built) {
+      failed = true;
+      continue;
+    }
+    files[name] = entry.path();
+    if (!built->second.params.empty()) {
+      continue;
+    }
+    macro m;
+    SHA256((const uint8_t *)name.data(), name.size(), (uint8_t *)&m);
+    app::macros[m] = {name, std::move(built->first)};
+  }
+
+  // Instances are checked like any other macro.
+  std::vector<const macro_sequence *> roots;
+  for (const auto &[m, loaded] : app::macros) {
+    roots.push_back(&loaded.seq);
+  }
+  failed = !specialize_all(roots, files,
+                           [](const std::string &name, const macro &m,
+                              std::pair<macro_sequence, macro_meta> built) {
+                             auto &loaded = app::macros[m];
+                             loaded = {name, std::move(built.first)};
+                             return &loaded.seq;
+                           }) ||
+           failed;
+
+  // Report in name order so runs diff cleanly.
+  std::vector<const loaded_macro *> sorted;
+  for (const auto &[m, loaded] : app::macros) {
+    sorted.push_back(&loaded);
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](auto *a, auto *b) { return a->name < b->name; });
+
+  for (const loaded_macro *loaded : sorted) {
+    report r = analyze(loaded->seq);
+    std::cout << loaded->name << ": ";
+    if (r.min_ms == r.max_ms) {
+      std::cout << r.min_ms << " ms";
+    } else {
+      std::cout << r.min_ms << "-" << r.max_ms << " ms";
+    }
+    if (r.endless) {
+      std::cout << " per loop, until cancelled";
+    }
+    std::cout << ", " << r.min_events;
+    if (r.max_events != r.min_events) {
+      std::cout << "-" << r.max_events;
+    }
+    std::cout << " events, up to " << r.max_held << " buttons held, "
+              << r.paths << (r.truncated ? "+" : "") << " paths";
+    if (r.truncated) {
+      std::cout << " (bounds cover the first " << max_paths << " only)";
+    }
+    std::cout << std::endl;
+    for (const auto &e : r.errors) {
+      std::cerr << "Error in [" << loaded->name << "]: " << e << std::endl;
+      failed = true;
+    }
+  }
+
+  std::cout << app::macros.size() << " macros checked" << std::endl;
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
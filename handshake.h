@@ -0,0 +1,71 @@
+#pragma once
+#include "common.h"
+#include <arpa/inet.h>
+#include <cstdint>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// What the client says first, in network byte order.
+inline uint32_t handshake_hello() { return htonl(0xDEADBEEF); }
+
+// The answer to the server's challenge x: x hashed x % 69 times. Both are in
+// network byte order.
+inline uint64_t handshake_answer(uint64_t x) {
+  x = ntohll(x);
+  uint64_t result = x;
+  uint64_t n = x % 69;
+  for (uint64_t i = 0; i < n; ++i) {
+    result = hash(result);
+  }
+  return htonll(result);
+}
+
+// Client side of the connection handshake: announce ourselves, then prove
+// we know the hash by answering the server's challenge.
+inline bool client_handshake(int socket) {
+  uint32_t initial_value = handshake_hello();
+  ssize_t sent_bytes = send(socket, &initial_value, sizeof(initial_value), 0);
+  if (sent_bytes < 0) {
+    std::cerr << "Failed to send initial value" << std::endl;
+    return false;
+  }
+
+  uint64_t x;
+  ssize_t received_bytes = recv(socket, &x, sizeof(x), MSG_WAITALL);
+  if (received_bytes != sizeof(x)) {
+    std::cerr << "Failed to receive value from server" << std::endl;
+    return false;
+  }
+  uint64_t result = handshake_answer(x);
+  ssize_t sent_hash_bytes = send(socket, &result, sizeof(result), 0);
+  if (sent_hash_bytes < 0) {
+    std::cerr << "Failed to send hashed value back to server" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Opens a TCP connection to a server and does the handshake. Returns the
+// socket, or -1.
+inline int connect_to_server(const std::string &address, uint16_t port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) <= 0 ||
+      connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      !client_handshake(sock)) {
+    close(sock);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return sock;
+}
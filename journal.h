@@ -0,0 +1,194 @@
+#pragma once
+#include "macros.h"
+#include "realtime.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Append-only binary log of every request the server receives. A journal
+// file is a header followed by fixed-size records, in native byte order.
+// Appending to an existing journal just adds records, so one file can span
+// several server runs.
+
+// The last byte is the format version.
+constexpr char journal_magic[8] = {'B', 'M', 'J', 'O', 'U', 'R', 'N', '1'};
+
+enum class journal_outcome : uint8_t {
+  played,
+  cooldown,
+  unknown,
+  paused,
+  dropped
+};
+
+inline const char *outcome_name(journal_outcome o) {
+  switch (o) {
+  case journal_outcome::played:
+    return "played";
+  case journal_outcome::cooldown:
+    return "cooldown";
+  case journal_outcome::unknown:
+    return "unknown";
+  case journal_outcome::paused:
+    return "paused";
+  case journal_outcome::dropped:
+    return "dropped";
+  }
+  return "?";
+}
+
+struct journal_record {
+  // Wall clock time the request arrived, in microseconds since the epoch.
+  uint64_t time_us;
+  uint32_t client;
+  journal_outcome outcome;
+  uint8_t reserved[3];
+  macro digest;
+};
+static_assert(sizeof(journal_record) == 48);
+
+// Converts a steady_clock receive time to wall clock microseconds.
+inline uint64_t journal_time(std::chrono::steady_clock::time_point t) {
+  auto wall = std::chrono::system_clock::now() -
+              (std::chrono::steady_clock::now() - t);
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             wall.time_since_epoch())
+      .count();
+}
+
+// Records are buffered and written by one background thread, in batches,
+// so the threads that log never wait on the disk. Both buffers are
+// allocated once when the journal opens and never grow: a record that
+// arrives while the buffer is full is dropped and counted. Real-time
+// workers log too, so the lock inherits priority.
+struct journal {
+  static constexpr size_t batch = 1024;
+  static constexpr size_t capacity = 16 * batch;
+
+  int fd = -1;
+  pi_mutex mut;
+  pi_cond cv;
+  std::vector<journal_record> pending;
+  // The batch being written, swapped with 'pending' by flush.
+  std::vector<journal_record> writing;
+  std::atomic<uint64_t> written = 0;
+  std::atomic<uint64_t> dropped = 0;
+
+  // Opens 'path' for appending, writing the header if the file is new. An
+  // existing file is only appended to if it is a whole journal of this
+  // version.
+  bool open(const std::string &path) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+      std::cerr << "Failed to open journal " << path << std::endl;
+      return false;
+    }
+    auto fail = [&](const char *why) {
+      std::cerr << why << ": " << path << std::endl;
+      close(fd);
+      fd = -1;
+      return false;
+    };
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size == 0) {
+      if (write(fd, journal_magic, sizeof(journal_magic)) !=
+          sizeof(journal_magic)) {
+        return fail("Failed to write journal header");
+      }
+    } else {
+      char header[sizeof(journal_magic)];
+      if (size < (off_t)sizeof(header) ||
+          pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+          std::memcmp(header, journal_magic, sizeof(header) - 1) != 0) {
+        return fail("Not a journal, refusing to append to it");
+      }
+      if (header[sizeof(header) - 1] != journal_magic[sizeof(header) - 1]) {
+        return fail("Journal is from another version, refusing to append");
+      }
+      if ((size - sizeof(header)) % sizeof(journal_record)) {
+        return fail("Journal ends in a partial record, refusing to append");
+      }
+    }
+    pending.reserve(capacity);
+    writing.reserve(capacity);
+    return true;
+  }
+
+  bool enabled() const { return fd >= 0; }
+
+  void append(uint64_t time_us, uint32_t client, const macro &digest,
+              journal_outcome outcome) {
+    if (fd < 0) {
+      return;
+    }
+    std::lock_guard lck(mut);
+    if (pending.size() == capacity) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    pending.push_back({time_us, client, outcome, {}, digest});
+    if (pending.size() >= batch) {
+      cv.notify_one();
+    }
+  }
+
+  // Writes out everything buffered so far. Only one thread flushes.
+  void flush() {
+    {
+      std::lock_guard lck(mut);
+      writing.swap(pending);
+    }
+    if (writing.empty()) {
+      return;
+    }
+    const size_t bytes = writing.size() * sizeof(journal_record);
+    if (write(fd, writing.data(), bytes) != (ssize_t)bytes) {
+      std::cerr << "Failed to write journal" << std::endl;
+    } else {
+      written += writing.size();
+    }
+    writing.clear();
+  }
+
+  // Flushes every full batch, and at least every 100ms, until 'running'
+  // goes false.
+  void run(const std::atomic_bool &running) {
+    while (running) {
+      {
+        std::unique_lock lck(mut);
+        if (pending.size() < batch) {
+          cv.wait_for(lck, std::chrono::milliseconds(100));
+        }
+      }
+      flush();
+    }
+  }
+};
+
+// Reads a whole journal. Returns false if the file can't be read or isn't a
+// journal.
+inline bool read_journal(const std::string &path,
+                         std::vector<journal_record> &out) {
+  mapped_file file(path);
+  std::string_view data = file.view();
+  if (!file.ok || data.size() < sizeof(journal_magic) ||
+      std::memcmp(data.data(), journal_magic, sizeof(journal_magic)) != 0) {
+    std::cerr << "Not a journal: " << path << std::endl;
+    return false;
+  }
+  data.remove_prefix(sizeof(journal_magic));
+  if (data.size() % sizeof(journal_record)) {
+    std::cerr << "Warning: journal " << path << " ends in a partial record"
+              << std::endl;
+  }
+  out.resize(data.size() / sizeof(journal_record));
+  std::memcpy(out.data(), data.data(), out.size() * sizeof(journal_record));
+  return true;
+}
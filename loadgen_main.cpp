@@ -0,0 +1,271 @@
+#include "common.h"
+#include "handshake.h"
+#include "macros.h"
+#include "random.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <netinet/in.h>
+#include <openssl/sha.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Drives a server with many concurrent clients to find where it falls over.
+// Run the server with 'controller null' and a metrics_port to see its side.
+
+using namespace std::chrono_literals;
+namespace chrono = std::chrono;
+namespace fs = std::filesystem;
+
+enum class distribution { uniform, hot, burst, unknown };
+
+namespace conf {
+std::string address = "127.0.0.1";
+uint16_t port = 6969;
+uint16_t metrics_port = 0;
+uint32_t clients = 4;
+double rate = 10; // requests per second per client
+uint32_t duration = 10;
+distribution dist = distribution::uniform;
+fs::path macro_dir = "macros";
+}; // namespace conf
+
+namespace app {
+std::atomic_bool running = true;
+std::atomic<uint64_t> sent = 0;
+std::atomic<uint64_t> failed = 0;
+std::atomic<uint32_t> connected = 0;
+std::vector<macro> digests;
+}; // namespace app
+
+macro pick_digest(xoshiro256 &gen) {
+  if (conf::dist == distribution::unknown || app::digests.empty()) {
+    macro m;
+    for (auto &b : m.data) {
+      b = (uint8_t)gen.next();
+    }
+    return m;
+  }
+  // Hot key: nine in ten requests go to the same macro.
+  if (conf::dist == distribution::hot && gen.below(10) != 0) {
+    return app::digests.front();
+  }
+  return app::digests[gen.below(app::digests.size())];
+}
+
+void run_client() {
+  int sock = connect_to_server(conf::address, conf::port);
+  if (sock < 0) {
+    std::cerr << "Failed to connect" << std::endl;
+    app::failed++;
+    return;
+  }
+  app::connected++;
+
+  xoshiro256 &gen = thread_rng();
+  const auto start = chrono::steady_clock::now();
+  const auto interval = chrono::duration<double>(1.0 / conf::rate);
+  uint64_t n = 0;
+  while (app::running) {
+    // Bursts send a whole second's worth at once, then go quiet.
+    size_t batch =
+        conf::dist == distribution::burst ? std::max<size_t>(1, conf::rate) : 1;
+    for (size_t i = 0; i < batch; i++) {
+      macro m = pick_digest(gen);
+      if (send(sock, &m, sizeof(m), MSG_NOSIGNAL) != sizeof(m)) {
+        app::failed++;
+        app::running = false;
+        break;
+      }
+      app::sent++;
+    }
+    n += batch;
+    std::this_thread::sleep_until(
+        start + chrono::duration_cast<chrono::steady_clock::duration>(
+                    interval * n));
+  }
+  close(sock);
+  app::connected--;
+}
+
+// Fetches the server's metrics page and sums every sample of each metric
+// name, ignoring labels.
+std::map<std::string, double> scrape() {
+  std::map<std::string, double> values;
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(conf::metrics_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (sock < 0 || connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (sock >= 0) {
+      close(sock);
+    }
+    return values;
+  }
+  const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+  send(sock, req, sizeof(req) - 1, MSG_NOSIGNAL);
+
+  std::string body;
+  char chunk[4096];
+  ssize_t got;
+  while ((got = recv(sock, chunk, sizeof(chunk), 0)) > 0) {
+    body.append(chunk, got);
+  }
+  close(sock);
+
+  std::istringstream ss(
+      body.substr(std::min(body.size(), body.find("\r\n\r\n"))));
+  std::string line;
+  while (std::getline(ss, line)) {
+    if (line.empty() || line[0] == '#' || line[0] == '\r') {
+      continue;
+    }
+    size_t space = line.rfind(' ');
+    if (space == std::string::npos) {
+      continue;
+    }
+    std::string name = line.substr(0, std::min(line.find('{'), space));
+    values[name] += std::strtod(line.c_str() + space + 1, nullptr);
+  }
+  return values;
+}
+
+void report() {
+  uint64_t last_sent = 0;
+  double last_requests = 0, last_lag_sum = 0, last_lag_count = 0;
+  double last_late_sum = 0, last_late_count = 0;
+  for (uint32_t second = 1; app::running && second <= conf::duration;
+       second++) {
+    std::this_thread::sleep_for(1s);
+    uint64_t sent = app::sent;
+    std::cout << "t=" << second << "s clients " << app::connected << " sent/s "
+              << sent - last_sent;
+    last_sent = sent;
+
+    if (conf::metrics_port) {
+      auto m = scrape();
+      double requests = m["barcode_requests_total"];
+      double lag_sum = m["barcode_playback_lag_seconds_sum"];
+      double lag_count = m["barcode_playback_lag_seconds_count"];
+      double lag_ms = lag_count > last_lag_count
+                          ? (lag_sum - last_lag_sum) /
+                                (lag_count - last_lag_count) * 1000
+                          : 0;
+      std::cout << " accepted/s " << requests - last_requests << " queued "
+                << m["barcode_client_queue_depth"] << " threads "
+                << m["barcode_threads"] << " in-flight "
+                << m["barcode_playbacks_in_flight"] << " lag "
+                << lag_ms << "ms";
+      // Average oversleep of the waits inside macros, the playback jitter.
+      double late_sum = m["barcode_wait_overshoot_seconds_sum"];
+      double late_count = m["barcode_wait_overshoot_seconds_count"];
+      if (late_count > last_late_count) {
+        std::cout << " wait overshoot "
+                  << (late_sum - last_late_sum) /
+                         (late_count - last_late_count) * 1e6
+                  << "us";
+      }
+      last_requests = requests;
+      last_lag_sum = lag_sum;
+      last_lag_count = lag_count;
+      last_late_sum = late_sum;
+      last_late_count = late_count;
+    }
+    std::cout << std::endl;
+  }
+  app::running = false;
+}
+
+bool parse_args(int argc, char **argv) {
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string_view opt = argv[i], value = argv[i + 1];
+    bool ok = true;
+    if (opt == "--address") {
+      conf::address = value;
+    } else if (opt == "--port") {
+      ok = parse_number(value, conf::port);
+    } else if (opt == "--metrics-port") {
+      ok = parse_number(value, conf::metrics_port);
+    } else if (opt == "--clients") {
+      ok = parse_number(value, conf::clients);
+    } else if (opt == "--rate") {
+      ok = parse_number(value, conf::rate) && conf::rate > 0;
+    } else if (opt == "--duration") {
+      ok = parse_number(value, conf::duration);
+    } else if (opt == "--macros") {
+      conf::macro_dir = value;
+    } else if (opt == "--dist") {
+      if (value == "uniform") {
+        conf::dist = distribution::uniform;
+      } else if (value == "hot") {
+        conf::dist = distribution::hot;
+      } else if (value == "burst") {
+        conf::dist = distribution::burst;
+      } else if (value == "unknown") {
+        conf::dist = distribution::unknown;
+      } else {
+        ok = false;
+      }
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      std::cerr << "Invalid option: " << opt << " " << value << std::endl;
+      return false;
+    }
+  }
+  return argc % 2 == 1;
+}
+
+void sigint(int) { app::running = false; }
+
+int main(int argc, char **argv) {
+  if (!parse_args(argc, argv)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--address ip] [--port n] [--metrics-port n] [--clients n]"
+                 " [--rate per-client/s] [--duration s] [--macros dir]"
+                 " [--dist uniform|hot|burst|unknown]"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  struct sigaction sa;
+  sa.sa_handler = sigint;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGINT, &sa, nullptr);
+
+  if (fs::is_directory(conf::macro_dir)) {
+    for (const auto &entry : fs::directory_iterator(conf::macro_dir)) {
+      const std::string name = entry.path().filename().string();
+      macro m;
+      SHA256((const uint8_t *)name.data(), name.size(), (uint8_t *)&m);
+      app::digests.push_back(m);
+    }
+  }
+  std::cout << "Loaded " << app::digests.size() << " macro names" << std::endl;
+
+  std::vector<std::thread> clients;
+  for (uint32_t i = 0; i < conf::clients; i++) {
+    clients.emplace_back(run_client);
+  }
+  report();
+  for (auto &t : clients) {
+    t.join();
+  }
+  std::cout << "Sent " << app::sent << " requests, " << app::failed
+            << " failures" << std::endl;
+}
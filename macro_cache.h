@@ -0,0 +1,86 @@
+#pragma once
+#include "cooldown.h"
+#include "macros.h"
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <map>
+#include <utility>
+
+// Rough resident size of a compiled macro, used to bound the cache.
+inline size_t sequence_bytes(const macro_sequence &seq) {
+  size_t bytes = sizeof(macro_sequence) + seq.code.capacity() * sizeof(instr);
+  for (const auto &table : seq.plays) {
+    for (const auto &name : table.names) {
+      bytes += name.capacity();
+    }
+    bytes += sizeof(table) + table.targets.capacity() * sizeof(macro) +
+             table.names.capacity() * sizeof(std::string) +
+             table.prob.capacity() * sizeof(float) +
+             table.alias.capacity() * sizeof(uint32_t);
+  }
+  return bytes;
+}
+
+// A compiled macro and the cooldown it asked for, with the scope of the macro
+// itself; its group's scope comes from the catalog. In lazy mode this is
+// the only place the cooldown parameters are kept.
+struct cached_macro {
+  sequence_ptr seq;
+  cooldown_spec cooldown{};
+};
+
+// Least recently used set of compiled macros, bounded by total size rather
+// than entry count. Not thread safe; callers hold app::macro_mut.
+struct macro_cache {
+  using entry = std::pair<macro, cached_macro>;
+
+  size_t budget;
+  size_t bytes = 0;
+  std::list<entry> order;
+  std::map<macro, std::list<entry>::iterator> entries;
+  std::atomic<uint64_t> hits = 0;
+  std::atomic<uint64_t> misses = 0;
+
+  explicit macro_cache(size_t budget) : budget(budget) {}
+
+  // Valid until the next put, erase or clear.
+  const cached_macro *get(const macro &m) {
+    auto it = entries.find(m);
+    if (it == entries.end()) {
+      misses++;
+      return nullptr;
+    }
+    hits++;
+    order.splice(order.begin(), order, it->second);
+    return &it->second->second;
+  }
+
+  void put(const macro &m, cached_macro entry) {
+    erase(m);
+    bytes += sequence_bytes(*entry.seq);
+    order.emplace_front(m, std::move(entry));
+    entries[m] = order.begin();
+
+    // Always keep the newest entry, even if it alone exceeds the budget.
+    while (bytes > budget && order.size() > 1) {
+      erase(order.back().first);
+    }
+  }
+
+  void erase(const macro &m) {
+    auto it = entries.find(m);
+    if (it == entries.end()) {
+      return;
+    }
+    bytes -= sequence_bytes(*it->second->second.seq);
+    order.erase(it->second);
+    entries.erase(it);
+  }
+
+  void clear() {
+    order.clear();
+    entries.clear();
+    bytes = 0;
+  }
+};
@@ -0,0 +1,188 @@
+#include "macros.h"
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Compiles a macro directory into a C++ header holding the whole macro table
+// as constexpr data. Any macro error makes this exit non-zero, which fails
+// the build.
+
+namespace fs = std::filesystem;
+
+const char *op_name(op code) {
+  switch (code) {
+  case op::press:
+    return "press";
+  case op::release:
+    return "release";
+  case op::press_all:
+    return "press_all";
+  case op::release_all:
+    return "release_all";
+  case op::wait:
+    return "wait";
+  case op::joy_l:
+    return "joy_l";
+  case op::joy_r:
+    return "joy_r";
+  case op::ramp_l:
+    return "ramp_l";
+  case op::ramp_r:
+    return "ramp_r";
+  case op::play:
+    return "play";
+  case op::sync:
+    return "sync";
+  case op::loop_begin:
+    return "loop_begin";
+  case op::loop_end:
+    return "loop_end";
+  }
+  return "sync";
+}
+
+std::string quoted(std::string_view s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+    }
+    out.push_back(c);
+  }
+  return out + "\"";
+}
+
+int main(int argc, char **argv) {
+  const fs::path macro_dir = argc > 1 ? argv[1] : "macros";
+  if (!fs::is_directory(macro_dir)) {
+    std::cerr << "Error: Macro directory '" << macro_dir
+              << "' does not exist or is not a directory.\n";
+    return EXIT_FAILURE;
+  }
+
+  // Sorted so the generated header only changes when the macros do.
+  std::vector<fs::path> paths;
+  for (const auto &entry : fs::directory_iterator(macro_dir)) {
+    if (entry.is_regular_file()) {
+      paths.push_back(entry.path());
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+
+  struct compiled {
+    std::string name;
+    macro_sequence seq;
+    macro_meta meta;
+  };
+  // A deque, so instances can point back into it while it grows.
+  std::deque<compiled> macros;
+  std::map<std::string, fs::path> files;
+  bool failed = false;
+  for (const auto &path : paths) {
+    auto built = build_macro(path);
+    if (!built) {
+      failed = true;
+      continue;
+    }
+    const std::string filename = path.filename().string();
+    files[filename] = path;
+    // Templates only exist through their instances.
+    if (!built->second.params.empty()) {
+      continue;
+    }
+    macros.push_back({filename, std::move(built->first), built->second});
+  }
+
+  std::vector<const macro_sequence *> roots;
+  for (const auto &c : macros) {
+    roots.push_back(&c.seq);
+  }
+  failed = !specialize_all(roots, files,
+                           [&](const std::string &name, const macro &,
+                               std::pair<macro_sequence, macro_meta> built) {
+                             macros.push_back({name, std::move(built.first),
+                                               built.second});
+                             return &macros.back().seq;
+                           }) ||
+           failed;
+
+  std::ostringstream os;
+  os << std::setprecision(std::numeric_limits<float>::max_digits10);
+  os << "// Generated by macrogen from " << macro_dir.string()
+     << "/. Do not edit.\n"
+        "#pragma once\n"
+        "#include \"builtin.h\"\n\n"
+        "namespace builtin {\n";
+
+  std::ostringstream table;
+  for (size_t n = 0; n < macros.size(); n++) {
+    const auto &[name, seq, meta] = macros[n];
+
+    os << "\nconstexpr instr code_" << n << "[] = {\n";
+    for (const auto &i : seq.code) {
+      os << "    {op::" << op_name(i.code) << ", " << i.key << ", " << i.arg
+         << ", " << i.x << ", " << i.y << "},";
+      if (i.code == op::press || i.code == op::release) {
+        os << " // " << profiles[seq.profile].key_name(i.key);
+      }
+      os << "\n";
+    }
+    os << "};\n";
+
+    for (size_t p = 0; p < seq.plays.size(); p++) {
+      const auto &t = seq.plays[p];
+      os << "constexpr builtin_target targets_" << n << "_" << p << "[] = {\n";
+      for (size_t k = 0; k < t.targets.size(); k++) {
+        os << "    {" << quoted(t.names[k]) << ", digest_of("
+           << quoted(t.names[k]) << "), " << t.prob[k] << ", " << t.alias[k]
+           << "},\n";
+      }
+      os << "};\n";
+    }
+    if (!seq.plays.empty()) {
+      os << "constexpr std::span<const builtin_target> plays_" << n
+         << "[] = {";
+      for (size_t p = 0; p < seq.plays.size(); p++) {
+        os << (p ? ", " : "") << "targets_" << n << "_" << p;
+      }
+      os << "};\n";
+    }
+
+    uint32_t base = 0, increment = 0, max = 0;
+    if (meta.cooldown) {
+      auto ms = [](duration_t d) {
+        return (uint32_t)chrono::duration_cast<chrono::milliseconds>(d)
+            .count();
+      };
+      base = ms(std::get<0>(*meta.cooldown));
+      increment = ms(std::get<1>(*meta.cooldown));
+      max = ms(std::get<2>(*meta.cooldown));
+    }
+
+    table << "    {digest_of(" << quoted(name) << "), code_" << n << ", "
+          << (seq.plays.empty() ? "{}" : "plays_" + std::to_string(n)) << ", "
+          << (meta.cooldown ? "true" : "false") << ", " << base << ", "
+          << increment << ", " << max << ", cooldown_scope::"
+          << (meta.scope == cooldown_scope::global ? "global" : "client")
+          << ", " << quoted(meta.group) << ", " << (int)seq.profile
+          << "},\n";
+  }
+
+  if (failed) {
+    return EXIT_FAILURE;
+  }
+
+  os << "\nconstexpr std::array<builtin_macro, " << macros.size()
+     << "> table = {{\n"
+     << table.str() << "}};\n\n";
+  os << "} // namespace builtin\n";
+  std::cout << os.str();
+}
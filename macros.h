@@ -1,20 +1,32 @@
 #pragma once
 #include "common.h"
 #include "controller.h"
+#include "random.h"
+#include "trace.h"
 #include <array>
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <filesystem>
-#include <fstream>
 #include <functional>
 #include <linux/input-event-codes.h>
 #include <map>
+#include <memory>
 #include <openssl/sha.h>
 #include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <syncstream>
 #include <termios.h>
 #include <thread>
 #include <tuple>
+#include <vector>
 
 using namespace std::chrono_literals;
 namespace chrono = std::chrono;
@@ -73,248 +85,1096 @@ inline std::string base64_encode(const uint8_t *data, size_t length) {
   return encoded;
 }
 
-using macro_fn = std::function<void(controller, const void *)>;
-using macro_sequence = std::vector<macro_fn>;
+enum class op : uint8_t {
+  press,
+  release,
+  press_all,
+  release_all,
+  wait,
+  joy_l,
+  joy_r,
+  ramp_l,
+  ramp_r,
+  play,
+  sync,
+  loop_begin,
+  loop_end,
+};
+
+// Flat, trivially copyable instruction. 'arg' is the wait time in ms for
+// op::wait and op::ramp_*, the index into macro_sequence::plays for
+// op::play, the index of the matching loop_end for op::loop_begin and the
+// repeat count for op::loop_end. A ramp always directly follows the joy_*
+// that sets its start.
+struct instr {
+  op code;
+  uint16_t key;
+  uint32_t arg;
+  float x, y;
+};
+
+// Targets of one 'play' command with a Vose alias table over their weights,
+// so a weighted pick costs one integer draw and one float draw.
+struct play_table {
+  std::vector<macro> targets;
+  // Barcodes as written in the source, for diagnostics and code generation.
+  std::vector<std::string> names;
+  std::vector<float> prob;
+  std::vector<uint32_t> alias;
 
-using context_t = const std::map<macro, macro_sequence>;
+  play_table() = default;
+
+  play_table(std::vector<macro> targets, std::vector<std::string> names,
+             const std::vector<double> &weights)
+      : targets(std::move(targets)), names(std::move(names)),
+        prob(weights.size()), alias(weights.size()) {
+    const size_t n = weights.size();
+    double total = 0;
+    for (double w : weights) {
+      total += w;
+    }
+
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; i++) {
+      scaled[i] = weights[i] * n / total;
+      (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
 
-inline void play_sequence(controller c, const macro_sequence &seq,
-                          context_t *context) {
-  for (const auto &action : seq) {
-    action(c, context);
+    while (!small.empty() && !large.empty()) {
+      uint32_t s = small.back(), l = large.back();
+      small.pop_back();
+      prob[s] = scaled[s];
+      alias[s] = l;
+      scaled[l] -= 1.0 - scaled[s];
+      if (scaled[l] < 1.0) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // Leftovers are 1 up to rounding error.
+    for (uint32_t i : large) {
+      prob[i] = 1.0f;
+      alias[i] = i;
+    }
+    for (uint32_t i : small) {
+      prob[i] = 1.0f;
+      alias[i] = i;
+    }
   }
+
+  const macro &pick(xoshiro256 &gen) const {
+    size_t i = gen.below(targets.size());
+    return gen.unit() < prob[i] ? targets[i] : targets[alias[i]];
+  }
+};
+
+// Repeat count of 'repeat until-cancel'.
+constexpr uint32_t repeat_forever = UINT32_MAX;
+constexpr size_t max_loop_depth = 16;
+
+struct macro_sequence {
+  std::vector<instr> code;
+  std::vector<play_table> plays;
+  // Index into 'profiles' of the device this macro plays on.
+  uint8_t profile = gamepad_profile;
+};
+
+using sequence_ptr = std::shared_ptr<const macro_sequence>;
+
+// Resolves a digest to its compiled sequence, or nullptr if it is unknown.
+using context_t = const std::function<sequence_ptr(const macro &)>;
+
+// Played in place of a macro that couldn't be found. Created once, so
+// substituting it never allocates.
+inline const sequence_ptr undefined_macro =
+    std::make_shared<const macro_sequence>();
+
+inline sequence_ptr or_undefined(sequence_ptr seq) {
+  return seq ? seq : undefined_macro;
 }
 
-inline const macro_sequence undefined_macro_seq = {
-    [](controller, const void *) {
-      // do some bs here;
-      std::cout << "huhh\n";
-    }};
-using duration_t = chrono::duration<float>;
+inline sequence_ptr lookup_sequence(context_t *context, const macro &m) {
+  return or_undefined((*context)(m));
+}
+
+// Lets a playback be stopped from another thread. The playback is cancelled
+// once 'epoch' moves past the value it had when playback started.
+struct cancel_token {
+  const std::atomic<uint64_t> *epoch = nullptr;
+  uint64_t start = 0;
+
+  bool cancelled() const { return epoch && *epoch != start; }
+};
+
+// Called with how late each wait woke up, if set.
+inline void (*on_wait_overshoot)(chrono::nanoseconds) = nullptr;
+
+// Sleeps until 'deadline' unless cancelled first. Returns false if cancelled.
+inline bool wait_until(chrono::steady_clock::time_point deadline,
+                       const cancel_token &cancel) {
+  if (!cancel.epoch) {
+    std::this_thread::sleep_until(deadline);
+  } else {
+    while (chrono::steady_clock::now() < deadline) {
+      if (cancel.cancelled()) {
+        return false;
+      }
+      std::this_thread::sleep_until(
+          std::min(deadline, chrono::steady_clock::now() + 10ms));
+    }
+  }
+  auto woke = chrono::steady_clock::now();
+  if (on_wait_overshoot) {
+    on_wait_overshoot(woke - deadline);
+  }
+  if (trace::enabled) {
+    trace::complete("overshoot", "jitter", deadline, woke);
+  }
+  return !cancel.cancelled();
+}
+
+constexpr chrono::milliseconds ramp_step = 10ms;
+
+// Milliseconds of wait and ramp played on this thread so far. A
+// 'repeat until-cancel' iteration that adds none, because every macro its
+// 'play' picked takes no time, would spin forever, so playback stops.
+inline thread_local uint64_t played_ms = 0;
 
-using build_ret = std::optional<
-    std::pair<macro_sequence,
-              std::optional<std::tuple<duration_t, duration_t, duration_t>>>>;
+// Per-event playback logging. Real-time mode turns it off, since blocking on
+// stdout in the middle of a macro adds jitter.
+inline std::atomic_bool playback_log = true;
 
-#define FAIL_HEADER                                                            \
-  "Error while parsing [" << unit << "] @ line_n " << line_n << " : \n\""      \
-                          << line << "\"\n"
-#define CHECK_TRAILING_OR_FAIL(ss, context)                                    \
+#define PLAYBACK_LOG(expr)                                                     \
   do {                                                                         \
-    std::string trailing;                                                      \
-    if (ss >> trailing) {                                                      \
-      std::cerr << FAIL_HEADER << "Unexpected trailing shit in '" << context   \
-                << "': '" << trailing << "'" << std::endl;                     \
-      return {};                                                               \
+    if (playback_log) {                                                        \
+      std::cout << expr << std::endl;                                          \
     }                                                                          \
   } while (0)
-inline build_ret build_macro(const fs::path &unit) {
-  macro_sequence sequence;
-  std::ifstream file(unit);
-  std::string line;
-  int line_n = 0;
 
-  if (!file.is_open()) {
-    std::cerr << "Error opening file: " << unit << std::endl;
-    return {};
+// Plays 'seq' to completion on the device for its profile, which 'play'ed
+// macros may not share. Returns false if it was cancelled part way.
+inline bool play_sequence(controller_set &devices, const macro_sequence &seq,
+                          context_t *context, const cancel_token &cancel = {}) {
+  const controller_profile &profile = profiles[seq.profile];
+  const controller c = devices.get(seq.profile);
+  // Loops currently running, innermost last.
+  struct loop_frame {
+    size_t begin;
+    uint32_t left;
+    // played_ms when the current iteration started.
+    uint64_t mark;
+  };
+  std::array<loop_frame, max_loop_depth> loops;
+  size_t depth = 0;
+
+  for (size_t pc = 0; pc < seq.code.size(); pc++) {
+    const instr &i = seq.code[pc];
+    if (cancel.cancelled()) {
+      return false;
+    }
+    switch (i.code) {
+    case op::press:
+      PLAYBACK_LOG("Pressing key: " << profile.key_name(i.key));
+      if (trace::enabled) {
+        trace::instant("press", "step",
+                       "\"key\":\"" + std::string(profile.key_name(i.key)) +
+                           "\"");
+      }
+      press_button(c, i.key);
+      break;
+    case op::release:
+      PLAYBACK_LOG("Releasing key: " << profile.key_name(i.key));
+      if (trace::enabled) {
+        trace::instant("release", "step",
+                       "\"key\":\"" + std::string(profile.key_name(i.key)) +
+                           "\"");
+      }
+      release_button(c, i.key);
+      break;
+    case op::press_all:
+      for (const auto &[k, code] : profile.by_code) {
+        PLAYBACK_LOG("Pressing key: " << k);
+        press_button(c, code);
+      }
+      break;
+    case op::release_all:
+      for (const auto &[k, code] : profile.by_code) {
+        PLAYBACK_LOG("Releasing key: " << k);
+        release_button(c, code);
+      }
+      break;
+    case op::wait: {
+      PLAYBACK_LOG("Waiting for " << i.arg << " ms");
+      trace::span span("wait", "step");
+      if (span.on) {
+        span.args = "\"ms\":" + std::to_string(i.arg);
+      }
+      sync(c);
+      played_ms += i.arg;
+      if (!wait_until(chrono::steady_clock::now() + chrono::milliseconds(i.arg),
+                      cancel)) {
+        return false;
+      }
+      break;
+    }
+    case op::joy_l:
+      PLAYBACK_LOG("Joystick L: (" << i.x << ", " << i.y << ")");
+      set_joystick(c, profile, side::left, {i.x, i.y});
+      break;
+    case op::joy_r:
+      PLAYBACK_LOG("Joystick R: (" << i.x << ", " << i.y << ")");
+      set_joystick(c, profile, side::right, {i.x, i.y});
+      break;
+    case op::ramp_l:
+    case op::ramp_r: {
+      const instr &from = seq.code[pc - 1];
+      PLAYBACK_LOG("Ramp " << (i.code == op::ramp_l ? "L" : "R") << ": ("
+                           << from.x << ", " << from.y << ") -> (" << i.x
+                           << ", " << i.y << ") over " << i.arg << " ms");
+      trace::span span(i.code == op::ramp_l ? "ramp_l" : "ramp_r", "step");
+      if (span.on) {
+        span.args = "\"ms\":" + std::to_string(i.arg);
+      }
+      // One step per ramp_step; a ramp shorter than that is a single step.
+      const uint32_t steps = std::max<uint32_t>(1, i.arg / ramp_step.count());
+      const auto start = chrono::steady_clock::now();
+      played_ms += i.arg;
+      for (uint32_t k = 1; k <= steps; k++) {
+        float t = (float)k / steps;
+        std::pair<float, float> at = {from.x + (i.x - from.x) * t,
+                                      from.y + (i.y - from.y) * t};
+        if (!wait_until(start + chrono::milliseconds(i.arg) * k / steps,
+                        cancel)) {
+          return false;
+        }
+        set_joystick(c, profile,
+                     i.code == op::ramp_l ? side::left : side::right, at);
+        sync(c);
+      }
+      break;
+    }
+    case op::play: {
+      const macro &selected_macro = seq.plays[i.arg].pick(thread_rng());
+      PLAYBACK_LOG("Playing macro with hash: '" << selected_macro << "'");
+      trace::span span("play", "step");
+      if (span.on) {
+        std::ostringstream os;
+        os << "\"macro\":\"" << selected_macro << "\"";
+        span.args = os.str();
+      }
+      if (!play_sequence(devices, *lookup_sequence(context, selected_macro),
+                         context, cancel)) {
+        return false;
+      }
+      break;
+    }
+    case op::sync:
+      sync(c);
+      break;
+    case op::loop_begin: {
+      uint32_t count = seq.code[i.arg].arg;
+      if (count == 0) {
+        pc = i.arg;
+      } else {
+        loops[depth++] = {pc, count, played_ms};
+      }
+      break;
+    }
+    case op::loop_end: {
+      loop_frame &loop = loops[depth - 1];
+      if (i.arg == repeat_forever) {
+        if (played_ms == loop.mark) {
+          std::cerr << "'repeat until-cancel' iteration took no time, "
+                       "stopping the macro"
+                    << std::endl;
+          return false;
+        }
+        loop.mark = played_ms;
+        pc = loop.begin;
+      } else if (--loop.left == 0) {
+        depth--;
+      } else {
+        pc = loop.begin;
+      }
+      break;
+    }
+    }
   }
+  return true;
+}
 
-  auto press_key = [](controller c, uint16_t key, const std::string &key_name) {
-    std::cout << "Pressing key: " << key_name << std::endl;
-    press_button(c, key);
-  };
+using duration_t = chrono::duration<float>;
 
-  auto release_key = [](controller c, uint16_t key,
-                        const std::string &key_name) {
-    std::cout << "Releasing key: " << key_name << std::endl;
-    release_button(c, key);
-  };
+enum class cooldown_scope : uint8_t { client, global };
 
-  auto wait = [](controller c, int ms) {
-    std::cout << "Waiting for " << ms << " ms" << std::endl;
-    sync(c);
-    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
-  };
+// Everything in a macro file that configures the server rather than the
+// playback itself.
+struct macro_meta {
+  std::optional<std::tuple<duration_t, duration_t, duration_t>> cooldown;
+  cooldown_scope scope = cooldown_scope::client;
+  // Macros sharing a group share one cooldown. Empty means ungrouped.
+  std::string group;
+  // Parameter names of a template, which can only be played through
+  // 'play [name(args)]'.
+  std::vector<std::string> params;
+};
 
-  auto joy_l = [](controller c, float x, float y) {
-    std::cout << "Joystick L: (" << x << ", " << y << ")" << std::endl;
-    set_joystick<side::left>(c, {x, y});
-  };
+using build_ret = std::optional<std::pair<macro_sequence, macro_meta>>;
+
+// Read-only view of a whole macro file. Empty files map to an empty view.
+struct mapped_file {
+  const char *data = nullptr;
+  size_t size = 0;
+  bool ok = false;
+
+  explicit mapped_file(const fs::path &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      size = st.st_size;
+      if (size == 0) {
+        ok = true;
+      } else {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+          data = (const char *)p;
+          ok = true;
+        }
+      }
+    }
+    close(fd);
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  ~mapped_file() {
+    if (data) {
+      munmap((void *)data, size);
+    }
+  }
+
+  std::string_view view() const { return {data, size}; }
+};
+
+struct diagnostic {
+  size_t line_n;
+  size_t col;
+  bool fatal;
+  std::string message;
+  std::string_view line;
+};
+
+enum class tok : uint8_t {
+  word,
+  lbracket,
+  rbracket,
+  lbrace,
+  rbrace,
+  lparen,
+  rparen,
+  comma,
+  colon,
+  end
+};
+
+struct token {
+  tok kind;
+  std::string_view text;
+  size_t col;
+};
 
-  auto joy_r = [](controller c, float x, float y) {
-    std::cout << "Joystick R: (" << x << ", " << y << ")" << std::endl;
-    set_joystick<side::right>(c, {x, y});
+// Merges the tracks of a 'parallel' block into one timeline. Each track is
+// laid out on its own clock, ramps become their individual steps, and the
+// events of all tracks are then played in time order with waits between
+// them. Ties keep track order. Tracks only hold press, release, joy, ramp
+// and wait instructions.
+inline std::vector<instr> merge_tracks(
+    const std::vector<std::vector<instr>> &tracks) {
+  struct timed {
+    uint64_t t;
+    instr i;
   };
+  std::vector<timed> events;
+  uint64_t end = 0;
+  for (const auto &track : tracks) {
+    uint64_t t = 0;
+    for (size_t pc = 0; pc < track.size(); pc++) {
+      const instr &i = track[pc];
+      if (i.code == op::wait) {
+        t += i.arg;
+      } else if (i.code == op::ramp_l || i.code == op::ramp_r) {
+        const instr &from = track[pc - 1];
+        const op joy = i.code == op::ramp_l ? op::joy_l : op::joy_r;
+        const uint32_t steps = std::max<uint32_t>(1, i.arg / ramp_step.count());
+        for (uint32_t k = 1; k <= steps; k++) {
+          float f = (float)k / steps;
+          events.push_back({t + (uint64_t)i.arg * k / steps,
+                            {joy, 0, 0, from.x + (i.x - from.x) * f,
+                             from.y + (i.y - from.y) * f}});
+        }
+        t += i.arg;
+      } else if (i.code != op::sync) {
+        events.push_back({t, i});
+      }
+    }
+    end = std::max(end, t);
+  }
+  std::stable_sort(events.begin(), events.end(),
+                   [](const timed &a, const timed &b) { return a.t < b.t; });
 
-  auto play_macro = [](controller c, const macro &macro, context_t *context) {
-    std::cout << "Playing macro with hash: '" << macro << "'" << std::endl;
-    play_sequence(c, context->at(macro), context);
+  std::vector<instr> out;
+  uint64_t cursor = 0;
+  auto wait_to = [&](uint64_t t) {
+    if (t > cursor) {
+      out.push_back({op::wait, 0, (uint32_t)(t - cursor), 0, 0});
+      cursor = t;
+    }
   };
+  for (const auto &e : events) {
+    wait_to(e.t);
+    out.push_back(e.i);
+  }
+  wait_to(end);
+  out.push_back({op::sync, 0, 0, 0, 0});
+  return out;
+}
+
+// Template parameter names and the arguments bound to them.
+using bindings_t = std::vector<std::pair<std::string_view, std::string_view>>;
+
+// Splits one line into words and the punctuation the macro syntax uses.
+// Tokens are views into the mapped file or the bound arguments; nothing is
+// copied. A '$name' word is replaced by its argument, and recorded in
+// 'unbound' if there is none.
+struct line_lexer {
+  std::string_view line;
+  const bindings_t *bindings = nullptr;
+  size_t pos = 0;
+  token unbound = {tok::end, {}, 0};
+
+  static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+  }
+
+  static bool is_punct(char c) {
+    return c == '[' || c == ']' || c == '{' || c == '}' || c == '(' ||
+           c == ')' || c == ',' || c == ':';
+  }
+
+  token next() {
+    while (pos < line.size() && is_space(line[pos])) {
+      pos++;
+    }
+    size_t col = pos + 1;
+    if (pos >= line.size()) {
+      return {tok::end, {}, col};
+    }
+    char c = line[pos];
+    if (is_punct(c)) {
+      pos++;
+      tok kind = c == '[' ? tok::lbracket
+                 : c == ']' ? tok::rbracket
+                 : c == '{' ? tok::lbrace
+                 : c == '}' ? tok::rbrace
+                 : c == '(' ? tok::lparen
+                 : c == ')' ? tok::rparen
+                 : c == ',' ? tok::comma
+                            : tok::colon;
+      return {kind, line.substr(col - 1, 1), col};
+    }
+    size_t start = pos;
+    while (pos < line.size() && !is_space(line[pos]) && !is_punct(line[pos])) {
+      pos++;
+    }
+    std::string_view word = line.substr(start, pos - start);
+    if (word.size() > 1 && word[0] == '$') {
+      if (bindings) {
+        for (const auto &[param, arg] : *bindings) {
+          if (param == word.substr(1)) {
+            return {tok::word, arg, col};
+          }
+        }
+      }
+      if (unbound.kind == tok::end) {
+        unbound = {tok::word, word, col};
+      }
+    }
+    return {tok::word, word, col};
+  }
 
-  std::optional<std::tuple<duration_t, duration_t, duration_t>> spec = {};
+  token peek() {
+    size_t saved = pos;
+    token t = next();
+    pos = saved;
+    return t;
+  }
+};
+
+template <typename T> inline bool parse_number(std::string_view s, T &out) {
+  auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+  return ec == std::errc{} && ptr == s.data() + s.size();
+}
 
-  while (std::getline(file, line)) {
+inline void report_diagnostics(const fs::path &unit,
+                               const std::vector<diagnostic> &diags) {
+  for (const auto &d : diags) {
+    std::cerr << (d.fatal ? "Error" : "Warning") << " while parsing [" << unit
+              << "] @ " << d.line_n << ":" << d.col << " : " << d.message
+              << "\n\"" << d.line << "\"" << std::endl;
+  }
+}
+
+// Parses a whole macro source. Every problem is recorded in 'diags' and
+// parsing resumes on the next line, so one pass reports all of them.
+// Templates only parse with 'args'; without them, parsing stops at the
+// 'params' line and the result is just the parameter names in meta.params.
+inline build_ret parse_macro(std::string_view src,
+                             std::vector<diagnostic> &diags,
+                             const std::vector<std::string> *args = nullptr) {
+  macro_sequence sequence;
+  macro_meta meta;
+  size_t line_n = 0;
+  bool failed = false;
+  bool any_command = false;
+  bindings_t bindings;
+
+  // 'repeat' and 'parallel' blocks not closed yet, innermost last.
+  struct open_block {
+    // Where the loop_begin, or the current parallel track, starts.
+    size_t begin;
+    uint32_t count;
+    // Whether the body waits at all. An endless loop that doesn't would
+    // spin a core and flood the controller.
+    bool timed;
+    size_t line_n, col;
+    std::string_view line;
+    bool parallel = false;
+    std::vector<std::vector<instr>> tracks = {};
+  };
+  std::vector<open_block> blocks;
+  auto mark_timed = [&] {
+    for (auto &b : blocks) {
+      b.timed = true;
+    }
+  };
+  auto in_parallel = [&] { return !blocks.empty() && blocks.back().parallel; };
+
+  while (!src.empty()) {
+    size_t eol = src.find('\n');
+    std::string_view line = src.substr(0, eol);
+    src.remove_prefix(eol == std::string_view::npos ? src.size() : eol + 1);
     line_n++;
-    if (line == "") {
+
+    line_lexer lex{line, &bindings};
+
+    auto report_error = [&](size_t col, std::string message) {
+      diags.push_back({line_n, col, true, std::move(message), line});
+      failed = true;
+      return false;
+    };
+    // Once a '$name' on the line has no argument, whatever else fails after
+    // it (e.g. the key lookup of 'press $x') follows from that, so only the
+    // unknown parameter is reported.
+    auto fail = [&](size_t col, std::string message) {
+      if (lex.unbound.kind != tok::end) {
+        failed = true;
+        return false;
+      }
+      return report_error(col, std::move(message));
+    };
+
+    auto expect = [&](tok kind, const char *what, token &out) {
+      out = lex.next();
+      if (out.kind != kind) {
+        return fail(out.col, std::string("expected ") + what);
+      }
+      return true;
+    };
+
+    auto expect_end = [&](std::string_view command) {
+      token t = lex.next();
+      if (t.kind != tok::end) {
+        return fail(t.col, "Unexpected trailing input in '" +
+                               std::string(command) + "': '" +
+                               std::string(t.text) + "'");
+      }
+      return true;
+    };
+
+    // Parses '[v, v, ...]' with exactly N numeric values.
+    auto number_list = [&]<typename T, size_t N>(std::string_view command,
+                                                 std::array<T, N> &out) {
+      token t;
+      if (!expect(tok::lbracket, "an opening bracket '['", t)) {
+        return false;
+      }
+      for (size_t n = 0; n < N; n++) {
+        if (n > 0 && !expect(tok::comma, "a comma", t)) {
+          return false;
+        }
+        if (!expect(tok::word, "a number", t)) {
+          return false;
+        }
+        if (!parse_number(t.text, out[n])) {
+          return fail(t.col, "'" + std::string(command) +
+                                 "' expects a number, got '" +
+                                 std::string(t.text) + "'");
+        }
+      }
+      return expect(tok::rbracket, "a closing bracket ']'", t) &&
+             expect_end(command);
+    };
+
+    token command = lex.next();
+    if (command.kind == tok::end || command.text.starts_with('#')) {
       continue;
     }
-
-    std::stringstream ss(line);
-    char comment;
-    if ((ss >> comment) && comment == '#') {
+    // Checked once the line is parsed, since any token may be a '$name'.
+    struct unbound_check {
+      line_lexer &lex;
+      decltype(report_error) &report;
+      ~unbound_check() {
+        if (lex.unbound.kind != tok::end) {
+          report(lex.unbound.col, "Unknown parameter: '" +
+                                      std::string(lex.unbound.text) + "'");
+        }
+      }
+    } check{lex, report_error};
+    const bool first_command = !any_command;
+    any_command = true;
+    if (command.kind == tok::rbrace) {
+      if (blocks.empty()) {
+        fail(command.col, "'}' without a matching 'repeat' or 'parallel'");
+        continue;
+      }
+      if (in_parallel()) {
+        // '} {' starts the next track, '}' ends the block.
+        open_block &block = blocks.back();
+        block.tracks.emplace_back(sequence.code.begin() + block.begin,
+                                  sequence.code.end());
+        sequence.code.resize(block.begin);
+        token t = lex.next();
+        if (t.kind == tok::lbrace) {
+          // Trailing input is reported, but the next track still starts,
+          // so the block's own '}' isn't reported as unmatched too.
+          expect_end("}");
+          continue;
+        }
+        if (t.kind != tok::end) {
+          fail(t.col, "expected '{' or the end of the line");
+        }
+        auto merged = merge_tracks(block.tracks);
+        sequence.code.insert(sequence.code.end(), merged.begin(), merged.end());
+        blocks.pop_back();
+        continue;
+      }
+      if (!expect_end("}")) {
+        continue;
+      }
+      open_block loop = blocks.back();
+      blocks.pop_back();
+      if (loop.count == repeat_forever && !loop.timed) {
+        diags.push_back({loop.line_n, loop.col, true,
+                         "'repeat until-cancel' needs a non-zero wait or ramp "
+                         "in its body",
+                         loop.line});
+        failed = true;
+        continue;
+      }
+      sequence.code[loop.begin].arg = sequence.code.size();
+      sequence.code.push_back({op::loop_end, 0, loop.count, 0, 0});
+      continue;
+    }
+    if (command.kind != tok::word) {
+      fail(command.col, "expected a command");
       continue;
     }
 
-    ss.str(line);
-    ss.clear();
-
-    std::string command;
-    ss >> command;
-    if (command == "cooldown") {
-      char bracket_open, bracket_close;
-      int base, increment, max;
-
-      if (!(ss >> bracket_open) || bracket_open != '[') {
-        std::cerr << FAIL_HEADER
-                  << "'cooldown' command expects an opening bracket '['."
-                  << std::endl;
-        return {};
-      }
-      if (!(ss >> base) || !(ss.ignore(1, ',')) || !(ss >> increment) ||
-          !(ss.ignore(1, ',')) || !(ss >> max)) {
-        std::cerr << FAIL_HEADER
-                  << "'cooldown' command requires three integer values "
-                     "separated by a comma."
-                  << std::endl;
-        return {};
-      }
-      if (!(ss >> bracket_close) || bracket_close != ']') {
-        std::cerr << FAIL_HEADER
-                  << "'cooldown' command expects a closing bracket "
-                     "']'.\n";
-        return {};
-      }
-      spec = {chrono::milliseconds(base), chrono::milliseconds(increment),
-              chrono::milliseconds(max)};
-    } else if (command == "press") {
-      std::string key;
-      if (!(ss >> key)) {
-        std::cerr << FAIL_HEADER << "'press' command requires a key name."
-                  << std::endl;
-        return {};
-      }
-      CHECK_TRAILING_OR_FAIL(ss, "press");
-      sequence.push_back([key, press_key](controller c, const void *) {
-        if (key == "ALL") {
-          for (const auto &[k, code] : keycode_map) {
-            press_key(c, code, k);
-          }
-          return;
+    const std::string_view name = command.text;
+    if (in_parallel() && (name == "play" || name == "repeat")) {
+      fail(command.col, "'" + std::string(name) +
+                            "' can't be used inside 'parallel', only press, "
+                            "release, wait, joy and ramp commands");
+      continue;
+    }
+    const bool left_stick = name == "joy_l" || name == "ramp_l";
+    if ((left_stick || name == "joy_r" || name == "ramp_r") &&
+        !profiles[sequence.profile].has_stick(left_stick ? side::left
+                                                         : side::right)) {
+      fail(command.col, "the " + std::string(profiles[sequence.profile].name) +
+                            " profile has no " +
+                            (left_stick ? "left" : "right") + " stick");
+      continue;
+    }
+    if (name == "params") {
+      if (!first_command) {
+        fail(command.col, "'params' must come before any other command");
+        continue;
+      }
+      for (token t = lex.next(); t.kind != tok::end; t = lex.next()) {
+        if (t.kind != tok::word) {
+          fail(t.col, "expected a parameter name");
+          break;
         }
-        press_key(c, keycode_map.at(key), key);
-      });
-    } else if (command == "release") {
-      std::string key;
-      if (!(ss >> key)) {
-        std::cerr << FAIL_HEADER << "'release' command requires a key name."
-                  << std::endl;
-        return {};
-      }
-      CHECK_TRAILING_OR_FAIL(ss, "release");
-      sequence.push_back([key, release_key](controller c, const void *) {
-        if (key == "ALL") {
-          for (const auto &[k, code] : keycode_map) {
-            release_key(c, code, k);
-          }
-          return;
+        meta.params.emplace_back(t.text);
+      }
+      if (!args) {
+        return std::pair{std::move(sequence), std::move(meta)};
+      }
+      if (args->size() != meta.params.size()) {
+        fail(command.col, "template takes " +
+                              std::to_string(meta.params.size()) +
+                              " arguments, got " + std::to_string(args->size()));
+        continue;
+      }
+      for (size_t n = 0; n < args->size(); n++) {
+        bindings.emplace_back(meta.params[n], (*args)[n]);
+      }
+    } else if (name == "profile") {
+      token t;
+      if (!expect(tok::word, "a profile name", t) || !expect_end(name)) {
+        continue;
+      }
+      if (!sequence.code.empty() || !blocks.empty()) {
+        fail(command.col, "'profile' must come before any key, stick, wait, "
+                          "play or block command");
+        continue;
+      }
+      auto p = find_profile(t.text);
+      if (!p) {
+        std::string known;
+        for (const auto &profile : profiles) {
+          known += (known.empty() ? "" : ", ") + std::string(profile.name);
         }
-        release_key(c, keycode_map.at(key), key);
-      });
-    } else if (command == "wait") {
-      int time_ms;
-      if (!(ss >> time_ms)) {
-        std::cerr << FAIL_HEADER
-                  << "'wait' command requires a time in milliseconds."
-                  << std::endl;
-        CHECK_TRAILING_OR_FAIL(ss, "wait");
-        return {};
-      }
-      sequence.push_back(
-          [time_ms, wait](controller c, const void *) { wait(c, time_ms); });
-    } else if (command == "joy_l" || command == "joy_r") {
-      char bracket_open, bracket_close;
-      float x, y;
-
-      if (!(ss >> bracket_open) || bracket_open != '[') {
-        std::cerr << FAIL_HEADER
-                  << "'joy_l'/'joy_r' command expects an opening bracket '['."
-                  << std::endl;
-        return {};
-      }
-      if (!(ss >> x) || !(ss.ignore(1, ',')) || !(ss >> y)) {
-        std::cerr << FAIL_HEADER
-                  << "'joy_l'/'joy_r' command requires two float values "
-                     "separated by a comma."
-                  << std::endl;
-        return {};
-      }
-      if (!(ss >> bracket_close) || bracket_close != ']') {
-        std::cerr << FAIL_HEADER
-                  << "'joy_l'/'joy_r' command expects a closing bracket "
-                     "']'.\n";
-        return {};
-      }
-
-      CHECK_TRAILING_OR_FAIL(ss, "joy_l/joy_r");
-      if (command == "joy_l") {
-        sequence.push_back(
-            [x, y, joy_l](controller c, const void *) { joy_l(c, x, y); });
+        fail(t.col, "Unknown profile: '" + std::string(t.text) +
+                        "', expected one of " + known);
+        continue;
+      }
+      sequence.profile = *p;
+    } else if (name == "cooldown") {
+      std::array<int, 3> v;
+      if (number_list(name, v)) {
+        meta.cooldown = {chrono::milliseconds(v[0]), chrono::milliseconds(v[1]),
+                         chrono::milliseconds(v[2])};
+      }
+    } else if (name == "cooldown_scope") {
+      token t;
+      if (!expect(tok::word, "'client' or 'global'", t) || !expect_end(name)) {
+        continue;
+      }
+      if (t.text == "client") {
+        meta.scope = cooldown_scope::client;
+      } else if (t.text == "global") {
+        meta.scope = cooldown_scope::global;
       } else {
-        sequence.push_back(
-            [x, y, joy_r](controller c, const void *) { joy_r(c, x, y); });
+        fail(t.col, "'cooldown_scope' expects 'client' or 'global', got '" +
+                        std::string(t.text) + "'");
+      }
+    } else if (name == "cooldown_group") {
+      token t;
+      if (expect(tok::word, "a group name", t) && expect_end(name)) {
+        meta.group = t.text;
+      }
+    } else if (name == "press" || name == "release") {
+      token key;
+      if (!expect(tok::word, "a key name", key) || !expect_end(name)) {
+        continue;
+      }
+      bool press = name == "press";
+      if (key.text == "ALL") {
+        sequence.code.push_back(
+            {press ? op::press_all : op::release_all, 0, 0, 0, 0});
+        continue;
+      }
+      auto code = profiles[sequence.profile].find_key(key.text);
+      if (!code) {
+        fail(key.col, "Unknown key: '" + std::string(key.text) + "' for the " +
+                          std::string(profiles[sequence.profile].name) +
+                          " profile");
+        continue;
       }
-    } else if (command == "play") {
-      std::string macro_id;
+      sequence.code.push_back(
+          {press ? op::press : op::release, *code, 0, 0, 0});
+    } else if (name == "wait") {
+      token t;
+      uint32_t time_ms;
+      if (!expect(tok::word, "a time in milliseconds", t)) {
+        continue;
+      }
+      if (!parse_number(t.text, time_ms)) {
+        fail(t.col, "'wait' command requires a time in milliseconds.");
+        continue;
+      }
+      if (expect_end(name)) {
+        sequence.code.push_back({op::wait, 0, time_ms, 0, 0});
+        if (time_ms > 0) {
+          mark_timed();
+        }
+      }
+    } else if (name == "joy_l" || name == "joy_r") {
+      std::array<float, 2> v;
+      if (number_list(name, v)) {
+        sequence.code.push_back(
+            {name == "joy_l" ? op::joy_l : op::joy_r, 0, 0, v[0], v[1]});
+      }
+    } else if (name == "ramp_l" || name == "ramp_r") {
+      std::array<float, 5> v;
+      if (!number_list(name, v)) {
+        continue;
+      }
+      if (!(v[4] >= 0 && v[4] < 4294967296.0f) || v[4] != std::floor(v[4])) {
+        fail(command.col, "'" + std::string(name) +
+                              "' expects a whole number of milliseconds last");
+        continue;
+      }
+      uint32_t ms = v[4];
+      bool left = name == "ramp_l";
+      sequence.code.push_back({left ? op::joy_l : op::joy_r, 0, 0, v[0], v[1]});
+      sequence.code.push_back(
+          {left ? op::ramp_l : op::ramp_r, 0, ms, v[2], v[3]});
+      if (ms > 0) {
+        mark_timed();
+      }
+    } else if (name == "play") {
       std::vector<macro> macros;
-      char bracket_open, bracket_close;
-
-      if (!(ss >> bracket_open) || bracket_open != '[') {
-        std::cerr << FAIL_HEADER
-                  << "'play' command expects an opening bracket '['."
-                  << std::endl;
-        return {};
+      std::vector<std::string> names;
+      std::vector<double> weights;
+      token t;
+      if (!expect(tok::lbracket, "an opening bracket '['", t)) {
+        continue;
       }
-
-      while (ss >> macro_id) {
+      bool ok = true;
+      do {
+        if (!(ok = expect(tok::word, "a macro name", t))) {
+          break;
+        }
+        // A template instance is named 'name(arg,arg)', spaces removed.
+        std::string target(t.text);
+        t = lex.next();
+        if (t.kind == tok::lparen) {
+          target += '(';
+          do {
+            if (!(ok = expect(tok::word, "a template argument", t))) {
+              break;
+            }
+            target.append(t.text);
+            t = lex.next();
+            target += t.kind == tok::comma ? ',' : ')';
+          } while (t.kind == tok::comma);
+          if (ok && t.kind != tok::rparen) {
+            ok = fail(t.col, "expected a closing parenthesis ')'");
+          }
+          if (!ok) {
+            break;
+          }
+          t = lex.next();
+        }
         macro m;
-        SHA256((const uint8_t *)macro_id.data(), macro_id.size(),
-               (uint8_t *)&m);
+        SHA256((const uint8_t *)target.data(), target.size(), (uint8_t *)&m);
         macros.push_back(m);
+        names.push_back(std::move(target));
+        weights.push_back(1.0);
 
-        if (ss.peek() == ',') {
-          ss.ignore();
+        if (t.kind == tok::colon) {
+          if (!(ok = expect(tok::word, "a weight", t))) {
+            break;
+          }
+          if (!parse_number(t.text, weights.back()) || !(weights.back() > 0) ||
+              !std::isfinite(weights.back())) {
+            ok = fail(t.col, "'play' weights must be positive numbers, got '" +
+                                 std::string(t.text) + "'");
+            break;
+          }
+          t = lex.next();
         }
+      } while (t.kind == tok::comma);
+      if (!ok) {
+        continue;
       }
-
-      if (!(ss >> bracket_close) || bracket_close != ']') {
-        std::cerr << FAIL_HEADER
-                  << "'play' command expects a closing bracket ']'.\n";
-        return {};
+      if (t.kind != tok::rbracket) {
+        fail(t.col, "'play' command expects a closing bracket ']'.");
+        continue;
       }
-
-      CHECK_TRAILING_OR_FAIL(ss, "play");
-      sequence.push_back(
-          [macros, play_macro](controller c, const void *context) {
-            size_t index = rand() % macros.size();
-            const macro &selected_macro = macros[index];
-            play_macro(c, selected_macro, (context_t *)context);
-          });
+      if (expect_end(name)) {
+        sequence.code.push_back(
+            {op::play, 0, (uint32_t)sequence.plays.size(), 0, 0});
+        sequence.plays.emplace_back(std::move(macros), std::move(names),
+                                     weights);
+        // Whether the played macro waits is only known once it is
+        // resolved; play_sequence stops a loop whose iteration didn't.
+        mark_timed();
+      }
+    } else if (name == "repeat") {
+      // 'repeat N {' or 'repeat until-cancel {', closed by a '}' line.
+      token t;
+      if (!expect(tok::word, "a repeat count or 'until-cancel'", t)) {
+        continue;
+      }
+      // A bad count still opens the block, so its '}' isn't reported too.
+      uint32_t count = 1;
+      if (t.text == "until-cancel") {
+        count = repeat_forever;
+      } else if (!parse_number(t.text, count) || count == repeat_forever) {
+        fail(t.col, "'repeat' expects a count or 'until-cancel', got '" +
+                        std::string(t.text) + "'");
+        count = 1;
+      }
+      token brace;
+      if (!expect(tok::lbrace, "an opening brace '{'", brace) ||
+          !expect_end(name)) {
+        continue;
+      }
+      if (blocks.size() == max_loop_depth) {
+        fail(command.col, "'repeat' blocks nest at most " +
+                              std::to_string(max_loop_depth) + " deep");
+        continue;
+      }
+      blocks.push_back(
+          {sequence.code.size(), count, false, line_n, command.col, line});
+      sequence.code.push_back({op::loop_begin, 0, 0, 0, 0});
+    } else if (name == "parallel") {
+      // 'parallel {', then tracks separated by '} {' lines, then '}'.
+      token brace;
+      if (!expect(tok::lbrace, "an opening brace '{'", brace) ||
+          !expect_end(name)) {
+        continue;
+      }
+      blocks.push_back(
+          {sequence.code.size(), 0, false, line_n, command.col, line, true});
     } else {
-      std::cerr << "Unknown command: " << command << std::endl;
+      diags.push_back({line_n, command.col, false,
+                       "Unknown command: " + std::string(name), line});
+    }
+  }
+
+  for (const auto &block : blocks) {
+    diags.push_back({block.line_n, block.col, true,
+                     std::string(block.parallel ? "'parallel'" : "'repeat'") +
+                         " block is never closed",
+                     block.line});
+    failed = true;
+  }
+
+  if (args && meta.params.empty() && !failed) {
+    diags.push_back({1, 1, true, "not a template, but was given arguments", {}});
+    failed = true;
+  }
+
+  if (failed) {
+    return {};
+  }
+
+  sequence.code.push_back({op::sync, 0, 0, 0, 0});
+  return std::pair{std::move(sequence), std::move(meta)};
+}
+
+inline build_ret build_macro(const fs::path &unit,
+                             const std::vector<std::string> *args = nullptr) {
+  mapped_file file(unit);
+  if (!file.ok) {
+    std::cerr << "Error opening file: " << unit << std::endl;
+    return {};
+  }
+
+  std::vector<diagnostic> diags;
+  auto ret = parse_macro(file.view(), diags, args);
+  report_diagnostics(unit, diags);
+  return ret;
+}
+
+// Whether a macro file is a template, judged from its first command alone
+// ('params' must come first), so nothing is compiled.
+inline bool is_template_file(const fs::path &unit) {
+  mapped_file file(unit);
+  std::string_view src = file.view();
+  while (!src.empty()) {
+    size_t eol = src.find('\n');
+    line_lexer lex{src.substr(0, eol)};
+    src.remove_prefix(eol == std::string_view::npos ? src.size() : eol + 1);
+    token command = lex.next();
+    if (command.kind == tok::end || command.text.starts_with('#')) {
+      continue;
     }
+    return command.kind == tok::word && command.text == "params";
   }
+  return false;
+}
 
-  sequence.push_back([](controller c, const void *) { sync(c); });
+// Splits a template instance name, 'name(a,b)', into the template's file
+// name and the arguments. Plain macro names give nullopt.
+inline std::optional<std::pair<std::string, std::vector<std::string>>>
+parse_instance(std::string_view target) {
+  size_t open = target.find('(');
+  if (open == std::string_view::npos || !target.ends_with(')')) {
+    return {};
+  }
+  std::vector<std::string> args;
+  std::string_view rest = target.substr(open + 1, target.size() - open - 2);
+  while (true) {
+    size_t comma = rest.find(',');
+    args.emplace_back(rest.substr(0, comma));
+    if (comma == std::string_view::npos) {
+      break;
+    }
+    rest.remove_prefix(comma + 1);
+  }
+  return std::pair{std::string(target.substr(0, open)), std::move(args)};
+}
+
+// Bounds how many instances one load may create, since a template can
+// play itself with new arguments.
+constexpr size_t max_instances = 4096;
 
-  return std::pair{sequence, spec};
+// Compiles every template instance played by 'roots', directly or through
+// other instances, once each. 'files' maps macro file names to paths.
+// 'emit(name, digest, compiled)' stores each instance and returns the
+// stored sequence, or nullptr if it won't be kept. Returns false if an
+// instance failed to compile.
+template <typename Emit>
+inline bool specialize_all(std::vector<const macro_sequence *> roots,
+                           const std::map<std::string, fs::path> &files,
+                           Emit emit) {
+  std::set<std::string> done;
+  bool ok = true;
+  while (!roots.empty()) {
+    const macro_sequence *seq = roots.back();
+    roots.pop_back();
+    for (const auto &table : seq->plays) {
+      for (size_t t = 0; t < table.names.size(); t++) {
+        const std::string &name = table.names[t];
+        auto instance = parse_instance(name);
+        if (!instance || !done.insert(name).second) {
+          continue;
+        }
+        auto file = files.find(instance->first);
+        if (file == files.end()) {
+          std::cerr << "Warning: no template named '" << instance->first
+                    << "' for '" << name << "'" << std::endl;
+          continue;
+        }
+        if (done.size() > max_instances) {
+          std::cerr << "Error: more than " << max_instances
+                    << " template instances, stopping at '" << name << "'"
+                    << std::endl;
+          return false;
+        }
+        auto built = build_macro(file->second, &instance->second);
+        if (!built) {
+          std::cerr << "Failed to instantiate '" << name << "'" << std::endl;
+          ok = false;
+          continue;
+        }
+        if (const macro_sequence *stored =
+                emit(name, table.targets[t], std::move(*built))) {
+          roots.push_back(stored);
+        }
+      }
+    }
+  }
+  return ok;
 }
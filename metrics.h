@@ -0,0 +1,118 @@
+#pragma once
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <netinet/in.h>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+
+namespace metrics {
+
+// Cumulative histogram in the Prometheus sense. Observations are lock free;
+// the sum is kept in microseconds so it can live in an integer atomic.
+struct histogram {
+  using bounds_t = std::array<double, 10>;
+  static constexpr bounds_t default_bounds = {0.01, 0.05, 0.1, 0.25, 0.5,
+                                              1,    2.5,  5,   10,   30};
+
+  histogram(const bounds_t &b = default_bounds) : bounds(b) {}
+
+  const bounds_t bounds;
+  std::array<std::atomic<uint64_t>, std::tuple_size_v<bounds_t> + 1> buckets{};
+  std::atomic<uint64_t> sum_us = 0;
+  std::atomic<uint64_t> count = 0;
+
+  void observe(std::chrono::duration<double> d) {
+    double s = d.count();
+    size_t i = 0;
+    while (i < bounds.size() && s > bounds[i]) {
+      i++;
+    }
+    buckets[i]++;
+    sum_us += (uint64_t)(s * 1e6);
+    count++;
+  }
+
+  void write(std::ostream &os, std::string_view name) const {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < bounds.size(); i++) {
+      cumulative += buckets[i];
+      os << name << "_bucket{le=\"" << bounds[i] << "\"} " << cumulative
+         << "\n";
+    }
+    cumulative += buckets[bounds.size()];
+    os << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+    os << name << "_sum " << sum_us / 1e6 << "\n";
+    os << name << "_count " << count << "\n";
+  }
+};
+
+inline std::atomic<uint64_t> requests = 0;
+inline std::atomic<uint64_t> in_flight = 0;
+inline std::atomic<uint64_t> unknown_macros = 0;
+// Requests dropped because the real-time playback queue was full.
+inline std::atomic<uint64_t> dropped = 0;
+inline histogram playback_seconds;
+// Time from a request arriving to its playback starting.
+inline histogram playback_lag;
+// How late each wait inside a macro woke up. This is the jitter real-time
+// mode is meant to cut, so the buckets are much finer.
+inline histogram wait_overshoot({0.00001, 0.00005, 0.0001, 0.00025, 0.0005,
+                                 0.001, 0.0025, 0.005, 0.01, 0.05});
+
+// Serves 'render()' as Prometheus text on 127.0.0.1:port, one response per
+// connection. Runs until the process exits.
+inline void serve(uint16_t port, std::function<std::string()> render) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    std::cerr << "Failed to create metrics socket" << std::endl;
+    return;
+  }
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(sock, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0) {
+    std::cerr << "Failed to bind metrics socket on port " << port << std::endl;
+    close(sock);
+    return;
+  }
+  std::cout << "Serving metrics on 127.0.0.1:" << port << std::endl;
+
+  while (true) {
+    int conn = accept(sock, nullptr, nullptr);
+    if (conn < 0) {
+      continue;
+    }
+    // Connections are served one at a time, so one that never sends its
+    // request or never reads the reply must not hold up the next scrape.
+    timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // The request itself doesn't matter, every path gets the metrics.
+    char discard[1024];
+    recv(conn, discard, sizeof(discard), 0);
+
+    std::string body = render();
+    std::string response = "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: " +
+                           std::to_string(body.size()) + "\r\n\r\n" + body;
+    send(conn, response.data(), response.size(), MSG_NOSIGNAL);
+    close(conn);
+  }
+}
+
+} // namespace metrics
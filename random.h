@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <random>
+
+inline uint64_t splitmix64(uint64_t &state) {
+  uint64_t z = (state += 0x9E3779B97F4A7C15);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+  return z ^ (z >> 31);
+}
+
+// xoshiro256** by Blackman and Vigna.
+struct xoshiro256 {
+  uint64_t s[4];
+
+  explicit xoshiro256(uint64_t seed) {
+    for (auto &word : s) {
+      word = splitmix64(seed);
+    }
+  }
+
+  static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+  uint64_t next() {
+    const uint64_t result = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+  }
+
+  // Unbiased integer in [0, n) (Lemire's multiply-shift with rejection).
+  uint64_t below(uint64_t n) {
+    __uint128_t m = (__uint128_t)next() * n;
+    uint64_t low = (uint64_t)m;
+    if (low < n) {
+      const uint64_t threshold = -n % n;
+      while (low < threshold) {
+        m = (__uint128_t)next() * n;
+        low = (uint64_t)m;
+      }
+    }
+    return m >> 64;
+  }
+
+  // Uniform double in [0, 1).
+  double unit() { return (next() >> 11) * 0x1.0p-53; }
+};
+
+namespace rng {
+// Zero means every thread seeds itself from the OS. Any other value makes
+// the n-th thread to draw always get the same stream.
+inline std::atomic<uint64_t> seed = 0;
+inline std::atomic<uint64_t> streams = 0;
+} // namespace rng
+
+inline xoshiro256 &thread_rng() {
+  thread_local xoshiro256 gen([] {
+    uint64_t s = rng::seed;
+    if (s == 0) {
+      std::random_device rd;
+      return ((uint64_t)rd() << 32) | rd();
+    }
+    uint64_t state = s + rng::streams++;
+    return splitmix64(state);
+  }());
+  return gen;
+}
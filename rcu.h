@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+// Pointer to an immutable value that readers follow without locking or
+// allocating. A writer publishes a whole new value and deletes the old one
+// once no reader can still see it. Writers must be serialized by the caller.
+template <typename T> struct rcu_cell {
+  // Keeps the value it points to alive. Hold it only briefly: a publish
+  // waits until every guard is gone.
+  struct guard {
+    std::atomic<uint32_t> *readers;
+    const T *ptr;
+
+    guard(std::atomic<uint32_t> *readers, const T *ptr)
+        : readers(readers), ptr(ptr) {}
+    guard(const guard &) = delete;
+    guard &operator=(const guard &) = delete;
+    ~guard() { readers->fetch_sub(1, std::memory_order_release); }
+
+    const T &operator*() const { return *ptr; }
+    const T *operator->() const { return ptr; }
+  };
+
+  std::atomic<const T *> current;
+  std::atomic<uint32_t> readers = 0;
+
+  explicit rcu_cell(std::unique_ptr<const T> initial)
+      : current(initial.release()) {}
+  rcu_cell(const rcu_cell &) = delete;
+  rcu_cell &operator=(const rcu_cell &) = delete;
+  ~rcu_cell() { delete current.load(); }
+
+  guard read() {
+    readers.fetch_add(1, std::memory_order_seq_cst);
+    return guard(&readers, current.load(std::memory_order_seq_cst));
+  }
+
+  // The current value, for the writer, which is the only one replacing it.
+  const T &writer_view() const {
+    return *current.load(std::memory_order_relaxed);
+  }
+
+  void publish(std::unique_ptr<const T> next) {
+    const T *old = current.exchange(next.release(), std::memory_order_seq_cst);
+    // A reader counted from here on already sees the new value.
+    while (readers.load(std::memory_order_seq_cst)) {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    delete old;
+  }
+};
@@ -0,0 +1,162 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <vector>
+
+// Pieces of real-time playback mode: a fixed-size job ring so handing a
+// request to a worker never allocates, priority-inheriting locks for
+// anything a worker shares with normal threads, and helpers to pin a worker
+// to a CPU under SCHED_FIFO and to lock the process in RAM.
+
+// Mutex with priority inheritance: while a SCHED_FIFO worker waits for it,
+// whoever holds it runs at the worker's priority, so a normal thread
+// preempted inside the lock can't hold the worker up indefinitely.
+struct pi_mutex {
+  pthread_mutex_t handle;
+
+  pi_mutex() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&handle, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+  pi_mutex(const pi_mutex &) = delete;
+  pi_mutex &operator=(const pi_mutex &) = delete;
+  ~pi_mutex() { pthread_mutex_destroy(&handle); }
+
+  void lock() { pthread_mutex_lock(&handle); }
+  void unlock() { pthread_mutex_unlock(&handle); }
+};
+
+// Condition variable for a pi_mutex. Timeouts use the monotonic clock.
+struct pi_cond {
+  pthread_cond_t handle;
+
+  pi_cond() {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&handle, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+  pi_cond(const pi_cond &) = delete;
+  pi_cond &operator=(const pi_cond &) = delete;
+  ~pi_cond() { pthread_cond_destroy(&handle); }
+
+  void notify_one() { pthread_cond_signal(&handle); }
+
+  // Waits for a notify or 'timeout', whichever comes first. 'lck' must hold
+  // the mutex; spurious wakeups are possible, as with any condition
+  // variable.
+  void wait_for(std::unique_lock<pi_mutex> &lck,
+                std::chrono::milliseconds timeout) {
+    timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout.count() / 1000;
+    deadline.tv_nsec += timeout.count() % 1000 * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&handle, &lck.mutex()->handle, &deadline);
+  }
+};
+
+template <typename T, size_t N> struct job_ring {
+  std::array<T, N> slots{};
+  size_t head = 0;
+  size_t count = 0;
+  pi_mutex mut;
+  pi_cond cv;
+
+  // Returns false if the ring is full.
+  bool push(const T &job) {
+    {
+      std::lock_guard lck(mut);
+      if (count == N) {
+        return false;
+      }
+      slots[(head + count) % N] = job;
+      count++;
+    }
+    cv.notify_one();
+    return true;
+  }
+
+  // Waits for a job. Returns false if 'running' went false first.
+  bool pop(T &job, const std::atomic_bool &running) {
+    std::unique_lock lck(mut);
+    while (count == 0) {
+      if (!running) {
+        return false;
+      }
+      cv.wait_for(lck, std::chrono::milliseconds(100));
+    }
+    job = slots[head];
+    head = (head + 1) % N;
+    count--;
+    return true;
+  }
+
+  size_t size() {
+    std::lock_guard lck(mut);
+    return count;
+  }
+};
+
+// Pins the calling thread to 'cpu' and gives it a SCHED_FIFO priority. Each
+// step that fails is reported and skipped, so without CAP_SYS_NICE the
+// thread still runs pinned at normal priority.
+inline void make_realtime(int cpu, int priority) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+    std::cerr << "Failed to pin playback worker to CPU " << cpu << ": "
+              << strerror(err) << std::endl;
+  }
+  sched_param param{};
+  param.sched_priority = priority;
+  if (int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+    std::cerr << "Failed to set SCHED_FIFO priority " << priority << ": "
+              << strerror(err) << std::endl;
+  }
+}
+
+// CPUs this process may run on, to spread workers over by default.
+inline std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  if (cpus.empty()) {
+    cpus.push_back(0);
+  }
+  return cpus;
+}
+
+// Locks every current and future page in RAM so playback never waits on a
+// page fault.
+inline bool lock_memory() {
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    std::cerr << "Failed to lock memory: " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,178 @@
+#pragma once
+#include "common.h"
+#include "controller.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Turns a live gamepad event stream into macro source. Sticks are only
+// sampled when they actually move, times are snapped to a grid, and runs of
+// samples that follow a straight line become a single ramp.
+struct recorder {
+  struct event {
+    uint32_t t;
+    bool is_key;
+    uint16_t key;
+    bool pressed;
+    side s;
+    float x, y;
+  };
+
+  // Stick changes smaller than this are sensor noise, not motion.
+  static constexpr float stick_epsilon = 0.01f;
+  // How far a sample may sit from the line and still be part of a ramp.
+  static constexpr float ramp_tolerance = 0.02f;
+
+  std::vector<event> events;
+  std::pair<float, float> last[2] = {{0, 0}, {0, 0}};
+
+  void key(uint32_t t, uint16_t code, bool pressed) {
+    events.push_back({t, true, code, pressed, side::left, 0, 0});
+  }
+
+  // Call once per SYN_REPORT with the stick's position after that frame, so
+  // an X and a Y update in the same frame become one sample.
+  void stick(uint32_t t, side s, float x, float y) {
+    auto &prev = last[(int)s];
+    if (std::abs(x - prev.first) < stick_epsilon &&
+        std::abs(y - prev.second) < stick_epsilon) {
+      return;
+    }
+    prev = {x, y};
+    events.push_back({t, false, 0, false, s, x, y});
+  }
+
+  static bool same_stick(const event &a, const event &b) {
+    return !a.is_key && !b.is_key && a.s == b.s;
+  }
+
+  // Snaps every event to 'grid' ms. A stick sampled more than once in one
+  // grid cell keeps only its last position there. Events of one key are at
+  // least one grid step apart, so snapping can't turn a short tap into a
+  // press and release at the same instant, and keys still down when
+  // recording stopped are released at the end.
+  std::vector<event> quantize(uint32_t grid) const {
+    std::vector<event> snapped;
+    // Per key: when it was pressed, if it is down, and the earliest time
+    // its next event may happen, one grid step after the last.
+    std::map<uint16_t, std::pair<std::optional<uint32_t>, uint32_t>> keys;
+    uint32_t end = 0;
+    for (event e : events) {
+      e.t = (e.t + grid / 2) / grid * grid;
+      if (e.is_key) {
+        auto &[down, next] = keys[e.key];
+        if (e.pressed == down.has_value()) {
+          continue;
+        }
+        e.t = std::max(e.t, next);
+        next = e.t + grid;
+        if (e.pressed) {
+          down = e.t;
+        } else {
+          down.reset();
+        }
+      }
+      end = std::max(end, e.t);
+      snapped.push_back(e);
+    }
+    for (const auto &[code, state] : keys) {
+      if (state.first) {
+        snapped.push_back(
+            {std::max(end, state.second), true, code, false, side::left, 0, 0});
+      }
+    }
+    // Holding a key down may have moved its release past later events.
+    std::stable_sort(snapped.begin(), snapped.end(),
+                     [](const event &a, const event &b) { return a.t < b.t; });
+
+    std::vector<event> out;
+    for (const event &e : snapped) {
+      if (!e.is_key) {
+        bool replaced = false;
+        for (size_t k = out.size(); k-- > 0 && out[k].t == e.t;) {
+          if (same_stick(out[k], e)) {
+            out[k].x = e.x;
+            out[k].y = e.y;
+            replaced = true;
+            break;
+          }
+        }
+        if (replaced) {
+          continue;
+        }
+      }
+      out.push_back(e);
+    }
+    return out;
+  }
+
+  // True if every sample strictly between 'from' and 'to' lies on the line
+  // between them, with time as the parameter.
+  static bool linear(const std::vector<event> &ev, size_t from, size_t to) {
+    const event &a = ev[from], &b = ev[to];
+    if (b.t <= a.t) {
+      return false;
+    }
+    for (size_t m = from + 1; m < to; m++) {
+      float f = (float)(ev[m].t - a.t) / (b.t - a.t);
+      if (std::abs(a.x + (b.x - a.x) * f - ev[m].x) > ramp_tolerance ||
+          std::abs(a.y + (b.y - a.y) * f - ev[m].y) > ramp_tolerance) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::string finish(uint32_t grid) const {
+    std::vector<event> ev = quantize(grid == 0 ? 1 : grid);
+    std::ostringstream os;
+    os << std::setprecision(3);
+    os << "# Recorded with a " << grid << " ms grid\n";
+
+    uint32_t cursor = ev.empty() ? 0 : ev.front().t;
+    auto wait_to = [&](uint32_t t) {
+      if (t > cursor) {
+        os << "wait " << t - cursor << "\n";
+        cursor = t;
+      }
+    };
+
+    for (size_t i = 0; i < ev.size(); i++) {
+      const event &e = ev[i];
+      wait_to(e.t);
+      if (e.is_key) {
+        os << (e.pressed ? "press " : "release ")
+           << profiles[gamepad_profile].key_name(e.key) << "\n";
+        continue;
+      }
+
+      // A ramp may only cover samples of this one stick with nothing else
+      // happening in between, since it blocks until it finishes.
+      size_t end = i;
+      for (size_t k = i + 1; k < ev.size() && same_stick(ev[k], e); k++) {
+        if (!linear(ev, i, k)) {
+          break;
+        }
+        end = k;
+      }
+
+      const char *name = e.s == side::left ? "l" : "r";
+      if (end >= i + 2) {
+        const event &b = ev[end];
+        os << "ramp_" << name << " [" << e.x << ", " << e.y << ", " << b.x
+           << ", " << b.y << ", " << b.t - e.t << "]\n";
+        cursor = b.t;
+        i = end;
+      } else {
+        os << "joy_" << name << " [" << e.x << ", " << e.y << "]\n";
+      }
+    }
+    return os.str();
+  }
+};
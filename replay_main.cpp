@@ -0,0 +1,164 @@
+#include "handshake.h"
+#include "journal.h"
+#include "macros.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Feeds a server's request journal back into a server, keeping the gaps
+// between requests (divided by --speed) and giving every journaled client
+// its own connection, so cooldowns see the same traffic they did live.
+
+using namespace std::chrono_literals;
+namespace chrono = std::chrono;
+
+namespace conf {
+std::string address = "127.0.0.1";
+uint16_t port = 6969;
+double speed = 1;
+bool dump = false;
+std::string journal_path;
+}; // namespace conf
+
+namespace app {
+std::atomic_bool running = true;
+}; // namespace app
+
+void dump(const std::vector<journal_record> &records) {
+  for (const auto &r : records) {
+    std::time_t secs = r.time_us / 1000000;
+    std::tm tm;
+    localtime_r(&secs, &tm);
+    std::cout << std::put_time(&tm, "%F %T") << "." << std::setfill('0')
+              << std::setw(6) << r.time_us % 1000000 << std::setfill(' ')
+              << " client " << r.client << " " << outcome_name(r.outcome)
+              << " '" << r.digest << "'\n";
+  }
+}
+
+int replay(const std::vector<journal_record> &records) {
+  std::map<uint32_t, int> sockets;
+  uint64_t sent = 0, failed = 0;
+  const auto start = chrono::steady_clock::now();
+  const uint64_t t0 = records.empty() ? 0 : records.front().time_us;
+
+  for (const auto &r : records) {
+    if (!app::running) {
+      break;
+    }
+    auto at = chrono::duration<double, std::micro>((r.time_us - t0) /
+                                                   conf::speed);
+    std::this_thread::sleep_until(
+        start + chrono::duration_cast<chrono::steady_clock::duration>(at));
+
+    auto [it, inserted] = sockets.try_emplace(r.client, -1);
+    if (inserted) {
+      it->second = connect_to_server(conf::address, conf::port);
+      if (it->second < 0) {
+        std::cerr << "Failed to connect for client " << r.client << std::endl;
+      }
+    }
+    if (it->second < 0 || send(it->second, &r.digest, sizeof(r.digest),
+                               MSG_NOSIGNAL) != sizeof(r.digest)) {
+      failed++;
+      continue;
+    }
+    sent++;
+  }
+
+  auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start);
+  double span = records.empty() ? 0 : (records.back().time_us - t0) / 1e6;
+  std::cout << "Replayed " << sent << " requests (" << failed
+            << " failed) from " << sockets.size() << " clients in "
+            << elapsed.count() << "s, originally " << span << "s" << std::endl;
+
+  // Give the server a moment to read the tail before hanging up.
+  std::this_thread::sleep_for(100ms);
+  for (const auto &[client, sock] : sockets) {
+    if (sock >= 0) {
+      close(sock);
+    }
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+bool parse_args(int argc, char **argv) {
+  int i = 1;
+  for (; i < argc; i++) {
+    std::string_view opt = argv[i];
+    if (opt == "--dump") {
+      conf::dump = true;
+      continue;
+    }
+    if (!opt.starts_with("--") || i + 1 >= argc) {
+      break;
+    }
+    std::string_view value = argv[++i];
+    bool ok = true;
+    if (opt == "--address") {
+      conf::address = value;
+    } else if (opt == "--port") {
+      ok = parse_number(value, conf::port);
+    } else if (opt == "--speed") {
+      ok = parse_number(value, conf::speed) && conf::speed > 0;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      std::cerr << "Invalid option: " << opt << " " << value << std::endl;
+      return false;
+    }
+  }
+  if (i + 1 != argc) {
+    return false;
+  }
+  conf::journal_path = argv[i];
+  return true;
+}
+
+void sigint(int) { app::running = false; }
+
+int main(int argc, char **argv) {
+  if (!parse_args(argc, argv)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--address ip] [--port n] [--speed factor] [--dump] journal"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  struct sigaction sa;
+  sa.sa_handler = sigint;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGINT, &sa, nullptr);
+
+  std::vector<journal_record> records;
+  if (!read_journal(conf::journal_path, records)) {
+    return EXIT_FAILURE;
+  }
+  // Batches from different threads can land slightly out of order.
+  std::stable_sort(records.begin(), records.end(),
+                   [](const journal_record &a, const journal_record &b) {
+                     return a.time_us < b.time_us;
+                   });
+
+  if (conf::dump) {
+    dump(records);
+    return EXIT_SUCCESS;
+  }
+  std::cout << "Replaying " << records.size() << " requests at "
+            << conf::speed << "x" << std::endl;
+  return replay(records);
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "macros.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <openssl/sha.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Consistent hash ring over a list of servers. Each server owns many points
+// on the ring, so adding or removing one only moves about 1/n of the
+// barcodes, and a digest always routes to the same server while it is up.
+struct hash_ring {
+  static constexpr size_t points_per_server = 64;
+
+  // (point, server index), sorted by point.
+  std::vector<std::pair<uint64_t, size_t>> points;
+  size_t servers = 0;
+
+  static uint64_t point_of(std::string_view s) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256((const uint8_t *)s.data(), s.size(), digest);
+    uint64_t p;
+    std::memcpy(&p, digest, sizeof(p));
+    return p;
+  }
+
+  explicit hash_ring(const std::vector<std::string> &names)
+      : servers(names.size()) {
+    for (size_t s = 0; s < names.size(); s++) {
+      for (size_t i = 0; i < points_per_server; i++) {
+        points.emplace_back(point_of(names[s] + "#" + std::to_string(i)), s);
+      }
+    }
+    std::sort(points.begin(), points.end());
+  }
+
+  // Every server, in the order a digest should try them: its owner first,
+  // then the next distinct servers clockwise round the ring.
+  std::vector<size_t> route(const macro &m) const {
+    std::vector<size_t> order;
+    if (points.empty()) {
+      return order;
+    }
+    uint64_t key;
+    std::memcpy(&key, m.data, sizeof(key));
+    size_t start = std::lower_bound(points.begin(), points.end(),
+                                    std::pair<uint64_t, size_t>{key, 0}) -
+                   points.begin();
+    for (size_t i = 0; i < points.size() && order.size() < servers; i++) {
+      size_t s = points[(start + i) % points.size()].second;
+      if (std::find(order.begin(), order.end(), s) == order.end()) {
+        order.push_back(s);
+      }
+    }
+    return order;
+  }
+};
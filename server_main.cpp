@@ -1,6 +1,18 @@
 #include "common.h"
 #include "controller.h"
+#include "cooldown.h"
+#include "journal.h"
+#ifdef BUILTIN_MACROS
+#include "builtin_macros.h"
+#endif
+#include "macro_cache.h"
 #include "macros.h"
+#include "metrics.h"
+#include "rcu.h"
+#include "realtime.h"
+#include "trace.h"
+#include "unknown_digests.h"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <atomic>
 #include <chrono>
@@ -11,6 +23,7 @@
 #include <ctime>
 #include <fcntl.h>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <map>
 #include <mutex>
@@ -18,61 +31,423 @@
 #include <openssl/sha.h>
 #include <ostream>
 #include <queue>
+#include <set>
+#include <sstream>
 #include <sys/socket.h>
-#include <termios.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 
 using namespace std::chrono_literals;
 namespace chrono = std::chrono;
 namespace fs = std::filesystem;
 
 namespace conn {
-constexpr uint16_t port = 6969;
+uint16_t port = 6969;
 constexpr size_t max_clients = 4;
 int socket;
 }; // namespace conn
 
-using duration_t = chrono::duration<float>;
-
-using spec_t = std::tuple<duration_t, duration_t, duration_t>;
+// A macro file, plus the arguments when it is an instance of a template.
+struct macro_source {
+  fs::path path;
+  std::vector<std::string> args;
+};
 
 namespace app {
-std::mutex macro_mut;
-std::map<macro, macro_sequence> macros;
+const fs::path macro_dir = "macros";
+bool lazy = false;
 std::atomic_bool running = true;
 std::atomic_bool paused = false;
-constexpr duration_t cooldown_increment = 1s;
-constexpr duration_t cooldown_base = 500ms;
-constexpr duration_t cooldown_max = 3s;
+constexpr uint32_t cooldown_increment_ms = 1000;
+constexpr uint32_t cooldown_base_ms = 500;
+constexpr uint32_t cooldown_max_ms = 3000;
+
+// Id 0 is shared by every unknown digest.
+constexpr uint32_t unknown_id = 0;
+constexpr cooldown_spec unknown_cooldown = {
+    cooldown_base_ms, cooldown_increment_ms, cooldown_max_ms, unknown_id,
+    false};
+}; // namespace app
+
+// Everything loaded from the macro directory. A catalog is never changed
+// once published: a reload builds a new one and swaps it in only after
+// every macro compiled, so a failed reload leaves the running macros, ids
+// and cooldowns exactly as they were.
+struct catalog {
+  std::map<macro, sequence_ptr> macros;
+  // Every macro file by digest. In lazy mode this is all that is built at
+  // startup, and app::cache holds whatever has been compiled since.
+  // Template instances are added as the macros that play them get compiled.
+  std::map<macro, macro_source> index;
+  // Macro files by file name, to find templates by name.
+  std::map<std::string, fs::path> files;
 
-constexpr spec_t default_cooldown = {cooldown_base, cooldown_increment,
-                                     cooldown_max};
+  // Dense ids for macros and cooldown groups, used to index the cooldown
+  // arrays. Ids are never reused, so they stay valid across reloads.
+  std::map<macro, uint32_t> ids;
+  std::map<std::string, uint32_t> groups;
+  // Bit n is set if a macro plays on profile n, so each client gets only
+  // those devices. The gamepad is always there.
+  uint32_t profiles = 1u << gamepad_profile;
+  // Cooldown settings by id. In lazy mode a compiled macro's own settings
+  // are kept with it in app::cache; only group scopes are recorded here.
+  std::vector<cooldown_spec> cooldowns = {app::unknown_cooldown};
+  uint32_t next_id = 1;
+};
 
-std::map<macro, spec_t> cooldown_specs;
+namespace app {
+// Requests read the catalog without taking any lock.
+rcu_cell<catalog> loaded{std::make_unique<const catalog>()};
+// Serializes reloads and lazy compiles, which publish new catalogs.
+std::mutex publish_mut;
+// Guards 'cache'.
+std::mutex macro_mut;
+macro_cache cache{1 << 20};
+// Cooldown rejections by macro id.
+chunked_array<std::atomic<uint64_t>> rejections;
+cooldown_table global_cooldowns;
+
+uint16_t metrics_port = 0;
+// Discard controller output instead of creating uinput devices, for load
+// testing without /dev/uinput.
+bool null_controller = false;
+std::string control_path = "/tmp/barcode-machine.sock";
+
+// Real-time mode plays macros on a fixed pool of pinned SCHED_FIFO workers
+// instead of a fresh thread per request.
+bool realtime = false;
+std::vector<int> realtime_cpus;
+uint32_t realtime_workers = 4;
+int realtime_priority = 50;
+
+// Where 'trace' and shutdown write the Chrome trace. Empty means tracing is
+// off.
+std::string trace_path;
+std::atomic<uint64_t> next_trace_id = 0;
+
+// Every request and what became of it, when 'journal_file' is set.
+std::string journal_path;
+journal request_journal;
+
+// Recent unknown digests, for the 'unknown' control command.
+unknown_digests unknown;
 }; // namespace app
 
+struct request {
+  macro digest;
+  chrono::steady_clock::time_point received;
+};
+
 struct client_info {
   int socket;
   std::mutex mut;
-  std::queue<macro> input_queue;
-  controller controller;
-  std::map<macro, std::pair<chrono::time_point<chrono::high_resolution_clock>,
-                            duration_t>>
-      cooldowns;
+  std::queue<request> input_queue;
+  controller_set controllers;
+  cooldown_table cooldowns;
   bool ready_to_die;
+  uint32_t id;
+  std::atomic<uint32_t> playing;
+  std::atomic_bool paused;
+  // Bumped to cancel every playback currently running for this client.
+  std::atomic<uint64_t> cancel_epoch;
 };
 
-void load_macros() {
-  const fs::path macro_dir = "macros";
+namespace app {
+std::mutex clients_mut;
+std::set<client_info *> clients;
+uint32_t next_client_id = 0;
+// Ids every cooldown table has room for.
+uint32_t reserved_ids = 0;
+}; // namespace app
 
-  if (!fs::exists(macro_dir) || !fs::is_directory(macro_dir)) {
-    std::cerr << "Error: Macro directory '" << macro_dir
-              << "' does not exist or is not a directory.\n";
+void read_conf() {
+  std::ifstream f("server.conf");
+  if (!f.is_open()) {
+    std::cout << "Failed to open config file, using default conf.\n";
+    return;
+  }
+
+  std::string var, value;
+  while (f >> var >> value) {
+    if (var == "port") {
+      try {
+        conn::port = static_cast<uint16_t>(std::stoi(value));
+      } catch (...) {
+        std::cerr << "Invalid value for port\n";
+      }
+    } else if (var == "lazy") {
+      app::lazy = value == "1" || value == "true";
+    } else if (var == "seed") {
+      try {
+        rng::seed = std::stoull(value);
+      } catch (...) {
+        std::cerr << "Invalid value for seed\n";
+      }
+    } else if (var == "metrics_port") {
+      try {
+        app::metrics_port = static_cast<uint16_t>(std::stoi(value));
+      } catch (...) {
+        std::cerr << "Invalid value for metrics_port\n";
+      }
+    } else if (var == "controller") {
+      app::null_controller = value == "null";
+    } else if (var == "control_socket") {
+      app::control_path = value;
+    } else if (var == "journal_file") {
+      app::journal_path = value;
+    } else if (var == "trace_file") {
+      app::trace_path = value;
+    } else if (var == "realtime") {
+      app::realtime = value == "1" || value == "true";
+    } else if (var == "realtime_cpus") {
+      app::realtime_cpus.clear();
+      std::istringstream ss(value);
+      std::string cpu;
+      while (std::getline(ss, cpu, ',')) {
+        int n;
+        if (!parse_number(std::string_view(cpu), n) || n < 0) {
+          std::cerr << "Invalid value for realtime_cpus\n";
+          app::realtime_cpus.clear();
+          break;
+        }
+        app::realtime_cpus.push_back(n);
+      }
+    } else if (var == "realtime_workers") {
+      try {
+        app::realtime_workers = std::max(1, std::stoi(value));
+      } catch (...) {
+        std::cerr << "Invalid value for realtime_workers\n";
+      }
+    } else if (var == "realtime_priority") {
+      try {
+        app::realtime_priority = std::stoi(value);
+      } catch (...) {
+        std::cerr << "Invalid value for realtime_priority\n";
+      }
+    } else if (var == "cache_bytes") {
+      try {
+        app::cache.budget = std::stoull(value);
+      } catch (...) {
+        std::cerr << "Invalid value for cache_bytes\n";
+      }
+    }
+  }
+}
+
+// Makes room for ids below 'n' in every cooldown table, so that checking a
+// cooldown never allocates.
+void reserve_ids(uint32_t n) {
+  std::lock_guard lck(app::clients_mut);
+  if (n <= app::reserved_ids) {
     return;
   }
+  app::reserved_ids = n;
+  app::rejections.reserve(n);
+  app::global_cooldowns.reserve(n);
+  for (client_info *client : app::clients) {
+    client->cooldowns.reserve(n);
+  }
+}
+
+// Swaps in a new catalog. Caller holds app::publish_mut. Devices for
+// profiles the new macros use are made first, so playback never waits for
+// one.
+void publish_catalog(std::unique_ptr<const catalog> next) {
+  reserve_ids(next->next_id);
+  {
+    std::lock_guard lck(app::clients_mut);
+    for (client_info *client : app::clients) {
+      client->controllers.create(next->profiles);
+    }
+  }
+  app::loaded.publish(std::move(next));
+}
+
+// Returns the id for a digest, assigning a new one on first sight.
+uint32_t assign_id(catalog &cat, const macro &m) {
+  auto it = cat.ids.find(m);
+  if (it != cat.ids.end()) {
+    return it->second;
+  }
+  if (cat.next_id >= cooldown_table::capacity) {
+    std::cerr << "Out of macro ids, sharing the unknown macro cooldown"
+              << std::endl;
+    return app::unknown_id;
+  }
+  uint32_t id = cat.next_id++;
+  cat.ids[m] = id;
+  cat.cooldowns.push_back({app::cooldown_base_ms, app::cooldown_increment_ms,
+                           app::cooldown_max_ms, id, false});
+  return id;
+}
+
+// The cooldown a compiled macro asks for, with its own scope. The slot is
+// left for the caller.
+cooldown_spec cooldown_params(const macro_meta &meta) {
+  cooldown_spec spec = {app::cooldown_base_ms, app::cooldown_increment_ms,
+                        app::cooldown_max_ms, app::unknown_id,
+                        meta.scope == cooldown_scope::global};
+  if (meta.cooldown) {
+    auto ms = [](duration_t d) {
+      return (uint32_t)chrono::duration_cast<chrono::milliseconds>(d).count();
+    };
+    const auto &[b, i, m] = *meta.cooldown;
+    spec.base_ms = ms(b);
+    spec.increment_ms = ms(i);
+    spec.max_ms = ms(m);
+  }
+  return spec;
+}
+
+// Records the cooldown settings of a compiled macro in 'cat' and takes
+// ownership of its sequence.
+sequence_ptr register_macro(catalog &cat, const macro &macro_id,
+                            macro_sequence sequence, const macro_meta &meta) {
+  cooldown_spec spec = cooldown_params(meta);
+  cat.profiles |= 1u << sequence.profile;
+  uint32_t id = assign_id(cat, macro_id);
+  spec.slot = id;
+  if (!meta.group.empty() && cat.next_id < cooldown_table::capacity) {
+    auto [it, inserted] = cat.groups.try_emplace(meta.group, cat.next_id);
+    if (inserted) {
+      cat.cooldowns.push_back(app::unknown_cooldown);
+      cat.next_id++;
+    }
+    spec.slot = it->second;
+  }
+  if (id != app::unknown_id) {
+    cat.cooldowns[id] = spec;
+    // A group is one cooldown, so one global member makes it global for
+    // every member.
+    cat.cooldowns[spec.slot].global |= spec.global;
+  }
+  return std::make_shared<const macro_sequence>(std::move(sequence));
+}
+
+// Whether register_macro and index_instances would change 'cat': a digest,
+// group or template instance seen for the first time, or a group getting
+// its first global member. Anything else about a lazily compiled macro
+// lives in the cache.
+bool changes_catalog(const catalog &cat, const macro &m,
+                     const macro_sequence &seq, const macro_meta &meta) {
+  if (!cat.ids.contains(m)) {
+    return true;
+  }
+  if (!meta.group.empty()) {
+    auto group = cat.groups.find(meta.group);
+    if (group == cat.groups.end() ||
+        (meta.scope == cooldown_scope::global &&
+         !cat.cooldowns[group->second].global)) {
+      return true;
+    }
+  }
+  for (const auto &table : seq.plays) {
+    for (size_t t = 0; t < table.names.size(); t++) {
+      auto instance = parse_instance(table.names[t]);
+      if (instance && cat.files.contains(instance->first) &&
+          !cat.index.contains(table.targets[t])) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Parses one macro file, or one instance of a template. Returns nothing if
+// it fails to parse or is a template, which can't be played without
+// arguments; 'is_template' tells which.
+build_ret build_source(const macro_source &source,
+                       bool *is_template = nullptr) {
+  auto built = build_macro(source.path,
+                           source.args.empty() ? nullptr : &source.args);
+  if (!built) {
+    std::cerr << "Failed to load macro from file: " << source.path.filename()
+              << std::endl;
+    return {};
+  }
+  if (!built->second.params.empty() && source.args.empty()) {
+    if (is_template) {
+      *is_template = true;
+    } else {
+      std::cerr << source.path.filename()
+                << " is a template and can only be played with arguments"
+                << std::endl;
+    }
+    return {};
+  }
+  return built;
+}
+
+// Adds the template instances 'seq' plays to the lazy index.
+void index_instances(catalog &cat, const macro_sequence &seq) {
+  for (const auto &table : seq.plays) {
+    for (size_t t = 0; t < table.names.size(); t++) {
+      auto instance = parse_instance(table.names[t]);
+      if (!instance) {
+        continue;
+      }
+      auto file = cat.files.find(instance->first);
+      if (file != cat.files.end()) {
+        cat.index.try_emplace(table.targets[t],
+                              macro_source{file->second, instance->second});
+      }
+    }
+  }
+}
+
+// Checks and updates the cooldown for macro 'id' without taking any lock.
+bool cooldown_allows(client_info *client, uint32_t id,
+                     const cooldown_spec &spec) {
+  auto &table = spec.global ? app::global_cooldowns : client->cooldowns;
+  if (!cooldown_try(table[spec.slot], spec.base_ms, spec.increment_ms,
+                    spec.max_ms, cooldown_now_ms())) {
+    app::rejections[id]++;
+    return false;
+  }
+  return true;
+}
+
+// Builds a new catalog (and in eager mode compiles every macro), then
+// publishes it. Ids, groups and cooldowns are staged in the new catalog
+// too, so on failure nothing the running server uses has changed.
+bool load_macros() {
+  std::lock_guard publish_lck(app::publish_mut);
+  auto next = std::make_unique<catalog>();
+  {
+    // Carry the ids over so cooldown state stays with its macro.
+    const catalog &cur = app::loaded.writer_view();
+    next->ids = cur.ids;
+    next->groups = cur.groups;
+    next->cooldowns = cur.cooldowns;
+    next->next_id = cur.next_id;
+  }
+  catalog &cat = *next;
+  // Group scopes are worked out again from the members that are left.
+  for (const auto &[name, slot] : cat.groups) {
+    cat.cooldowns[slot].global = false;
+  }
+
+#ifdef BUILTIN_MACROS
+  // The table was compiled in at build time, so there is nothing to read,
+  // parse or hash here, and nothing to reload.
+  for (const auto &b : builtin::table) {
+    cat.macros[b.digest] =
+        register_macro(cat, b.digest, to_sequence(b), to_meta(b));
+  }
+  std::cout << "Loaded " << cat.macros.size() << " built-in macros"
+            << std::endl;
+  app::lazy = false;
+#else
+  if (!fs::exists(app::macro_dir) || !fs::is_directory(app::macro_dir)) {
+    std::cerr << "Error: Macro directory '" << app::macro_dir
+              << "' does not exist or is not a directory.\n";
+    return true;
+  }
 
-  for (const auto &entry : fs::directory_iterator(macro_dir)) {
+  for (const auto &entry : fs::directory_iterator(app::macro_dir)) {
     if (!entry.is_regular_file()) {
       continue;
     }
@@ -84,32 +459,304 @@ void load_macros() {
     SHA256((const uint8_t *)filename.data(), filename.size(),
            (uint8_t *)&macro_id);
 
-    auto sequence_opt = build_macro(path);
-    if (!sequence_opt) {
-      std::cerr << "Failed to load macro from file: " << filename << std::endl;
-      exit(EXIT_FAILURE);
+    cat.files[filename] = path;
+    if (app::lazy) {
+      // A template can't be scanned, only played with arguments, so it is
+      // left out of the index and its barcode counts as unknown.
+      if (is_template_file(path)) {
+        std::cout << "Indexed template: " << filename << std::endl;
+        continue;
+      }
+      cat.index[macro_id] = {path, {}};
+      assign_id(cat, macro_id);
+      continue;
     }
+    cat.index[macro_id] = {path, {}};
 
-    auto [sequence, spec_opt] = std::move(*sequence_opt);
-    std::lock_guard lck(app::macro_mut);
-    app::cooldown_specs[macro_id] = spec_opt.value_or(app::default_cooldown);
-    app::macros[macro_id] = sequence;
+    bool is_template = false;
+    auto built = build_source({path, {}}, &is_template);
+    if (is_template) {
+      std::cout << "Loaded template: " << filename << std::endl;
+      continue;
+    }
+    if (!built) {
+      return false;
+    }
+
+    cat.macros[macro_id] = register_macro(cat, macro_id,
+                                          std::move(built->first),
+                                          built->second);
     std::cout << "Loaded macro: " << filename << " with hash '" << macro_id
               << "'" << std::endl;
   }
+
+  if (app::lazy) {
+    std::cout << "Indexed " << cat.index.size() << " macros" << std::endl;
+  } else {
+    std::vector<const macro_sequence *> roots;
+    for (const auto &[m, seq] : cat.macros) {
+      roots.push_back(seq.get());
+    }
+    bool ok = specialize_all(
+        roots, cat.files,
+        [&](const std::string &name, const macro &m,
+            std::pair<macro_sequence, macro_meta> built)
+            -> const macro_sequence * {
+          auto &[seq, meta] = built;
+          sequence_ptr ptr = register_macro(cat, m, std::move(seq), meta);
+          cat.macros[m] = ptr;
+          std::cout << "Instantiated macro: " << name << std::endl;
+          return ptr.get();
+        });
+    if (!ok) {
+      return false;
+    }
+  }
+#endif
+
+  publish_catalog(std::move(next));
+  auto lck = trace::lock(app::macro_mut, "wait macro_mut");
+  app::cache.clear();
+  return true;
+}
+
+// What a request needs from the catalog: the compiled macro, or nullptr if
+// it is unknown, and the cooldown it plays under.
+struct resolved_macro {
+  sequence_ptr seq;
+  uint32_t id = app::unknown_id;
+  cooldown_spec cooldown = app::unknown_cooldown;
+};
+
+// The cooldown macro 'id' plays under, with its group's scope.
+cooldown_spec cooldown_of(const catalog &cat, uint32_t id) {
+  cooldown_spec spec = cat.cooldowns[id];
+  spec.global = cat.cooldowns[spec.slot].global;
+  return spec;
+}
+
+// Looks up a compiled macro, compiling it on first use in lazy mode. In
+// eager mode this takes no lock.
+resolved_macro resolve_macro(const macro &m) {
+  resolved_macro out;
+  macro_source source;
+  {
+    auto cat = app::loaded.read();
+    if (auto it = cat->ids.find(m); it != cat->ids.end()) {
+      out.id = it->second;
+      out.cooldown = cooldown_of(*cat, out.id);
+    }
+
+    if (!app::lazy) {
+      auto it = cat->macros.find(m);
+      if (it == cat->macros.end()) {
+        metrics::unknown_macros++;
+      } else {
+        out.seq = it->second;
+      }
+      return out;
+    }
+
+    {
+      auto lck = trace::lock(app::macro_mut, "wait macro_mut");
+      if (const cached_macro *hit = app::cache.get(m)) {
+        out.seq = hit->seq;
+        out.cooldown = hit->cooldown;
+        out.cooldown.global |= cat->cooldowns[out.cooldown.slot].global;
+        return out;
+      }
+    }
+    auto it = cat->index.find(m);
+    if (it == cat->index.end()) {
+      metrics::unknown_macros++;
+      return out;
+    }
+    source = it->second;
+  }
+
+  auto built = build_source(source);
+
+  std::lock_guard publish_lck(app::publish_mut);
+  const catalog &cur = app::loaded.writer_view();
+  auto it = cur.index.find(m);
+  if (it == cur.index.end() || it->second.path != source.path) {
+    // A reload replaced the file while it compiled; play what was built but
+    // leave the new catalog alone.
+    if (built) {
+      out.seq = std::make_shared<const macro_sequence>(
+          std::move(built->first));
+    }
+    return out;
+  }
+  if (!built) {
+    // Don't retry a broken file on every scan.
+    auto next = std::make_unique<catalog>(cur);
+    next->index.erase(m);
+    publish_catalog(std::move(next));
+    out.id = app::unknown_id;
+    out.cooldown = app::unknown_cooldown;
+    return out;
+  }
+
+  // Only a first sight changes the catalog. Recompiling after an eviction,
+  // the common case, just refills the cache.
+  auto &[seq, meta] = *built;
+  cached_macro entry;
+  if (changes_catalog(cur, m, seq, meta)) {
+    auto next = std::make_unique<catalog>(cur);
+    entry.seq = register_macro(*next, m, std::move(seq), meta);
+    index_instances(*next, *entry.seq);
+    auto id = next->ids.find(m);
+    out.id = id == next->ids.end() ? app::unknown_id : id->second;
+    entry.cooldown = next->cooldowns[out.id];
+    publish_catalog(std::move(next));
+  } else {
+    out.id = cur.ids.at(m);
+    entry.cooldown = cooldown_params(meta);
+    entry.cooldown.slot =
+        meta.group.empty() ? out.id : cur.groups.at(meta.group);
+    entry.seq = std::make_shared<const macro_sequence>(std::move(seq));
+  }
+  out.seq = entry.seq;
+  out.cooldown = entry.cooldown;
+  out.cooldown.global |=
+      app::loaded.writer_view().cooldowns[out.cooldown.slot].global;
+
+  auto lck = trace::lock(app::macro_mut, "wait macro_mut");
+  app::cache.put(m, std::move(entry));
+  std::cout << "Compiled macro: " << source.path.filename().string();
+  for (size_t n = 0; n < source.args.size(); n++) {
+    std::cout << (n ? "," : "(") << source.args[n]
+              << (n + 1 == source.args.size() ? ")" : "");
+  }
+  std::cout << " (cache hits: "
+            << app::cache.hits << ", misses: " << app::cache.misses
+            << ", bytes: " << app::cache.bytes << ")" << std::endl;
+  return out;
+}
+
+context_t resolver = [](const macro &m) { return resolve_macro(m).seq; };
+
+// Whether 'm' names a macro that is loaded, or in lazy mode could be
+// compiled. Never compiles or allocates.
+bool known_macro(const macro &m) {
+  auto cat = app::loaded.read();
+  return app::lazy ? cat->index.contains(m) : cat->macros.contains(m);
+}
+
+struct playback_job {
+  client_info *client;
+  request req;
+  cancel_token cancel;
+};
+
+// Resolves and plays one request. The caller has already counted it in
+// client->playing; this uncounts it when done.
+void play_request(const playback_job &job) {
+  client_info *client = job.client;
+  const macro &m = job.req.digest;
+  // Uncounts the request, and ends its trace span, on every return path.
+  struct done_guard {
+    client_info *client;
+    uint64_t trace_id;
+    const char *outcome;
+    ~done_guard() {
+      if (trace_id) {
+        trace::async_end("request", client->id, trace_id,
+                         "\"outcome\":\"" + std::string(outcome) + "\"");
+      }
+      client->playing--;
+    }
+  } done{client, 0, "played"};
+  if (trace::enabled) {
+    done.trace_id = ++app::next_trace_id;
+    std::ostringstream os;
+    os << "\"macro\":\"" << m << "\"";
+    trace::async_begin("request", client->id, done.trace_id, job.req.received,
+                       os.str());
+  }
+
+  resolved_macro resolved;
+  {
+    trace::span span("resolve", "request");
+    resolved = resolve_macro(m);
+  }
+  {
+    trace::span span("cooldown", "request");
+    if (!cooldown_allows(client, resolved.id, resolved.cooldown)) {
+      done.outcome = "cooldown";
+      app::request_journal.append(journal_time(job.req.received), client->id,
+                                  m, journal_outcome::cooldown);
+      return;
+    }
+  }
+  app::request_journal.append(
+      journal_time(job.req.received), client->id, m,
+      resolved.seq ? journal_outcome::played : journal_outcome::unknown);
+  sequence_ptr seq = or_undefined(resolved.seq);
+
+  PLAYBACK_LOG("Playing macro with hash: '" << m << "'");
+  metrics::in_flight++;
+  auto start = chrono::steady_clock::now();
+  metrics::playback_lag.observe(start - job.req.received);
+  trace::span span("playback", "request");
+  if (!play_sequence(client->controllers, *seq, &resolver, job.cancel)) {
+    done.outcome = "cancelled";
+    // Don't leave buttons held by a cancelled macro stuck down.
+    client->controllers.release_all();
+    PLAYBACK_LOG("Cancelled macro with hash: '" << m << "'");
+  }
+  metrics::playback_seconds.observe(chrono::steady_clock::now() - start);
+  metrics::in_flight--;
+}
+
+namespace app {
+job_ring<playback_job, 1024> jobs;
+}; // namespace app
+
+void playback_worker(int cpu) {
+  make_realtime(cpu, app::realtime_priority);
+  playback_job job;
+  while (app::jobs.pop(job, app::running)) {
+    play_request(job);
+  }
+}
+
+// Starts real-time mode: every macro compiled up front, memory locked,
+// per-event logging off and the worker pool started.
+void start_realtime() {
+  app::lazy = false;
+  playback_log = false;
+  if (app::realtime_cpus.empty()) {
+    app::realtime_cpus = allowed_cpus();
+  }
+  lock_memory();
+  for (uint32_t i = 0; i < app::realtime_workers; i++) {
+    std::thread(playback_worker,
+                app::realtime_cpus[i % app::realtime_cpus.size()])
+        .detach();
+  }
+  std::cout << "Real-time playback on " << app::realtime_workers
+            << " workers" << std::endl;
 }
 
 bool check_queue_empty(client_info *client) {
-  std::lock_guard lck(client->mut);
+  auto lck = trace::lock(client->mut, "wait client->mut");
   return client->input_queue.empty();
 }
 
 void client_connection(client_info *client) {
+  // The devices for every profile the loaded macros use. Here rather than
+  // in the accept loop, so settling doesn't hold up other clients
+  // connecting. No scan is read until it is done.
+  const uint32_t used = app::loaded.read()->profiles;
+  client->controllers.create(used);
   while (app::running) {
 
     macro buf;
-    ssize_t received_bytes = recv(client->socket, &buf, sizeof(buf), 0);
-    if (received_bytes == 0) {
+    ssize_t received_bytes =
+        recv(client->socket, &buf, sizeof(buf), MSG_WAITALL);
+    if (received_bytes <= 0) {
       client->ready_to_die = true;
       return;
     }
@@ -119,12 +766,34 @@ void client_connection(client_info *client) {
       continue;
     }
 
-    if (app::paused) {
+    if (app::paused || client->paused) {
+      app::request_journal.append(journal_time(chrono::steady_clock::now()),
+                                  client->id, buf, journal_outcome::paused);
+      continue;
+    }
+    metrics::requests++;
+    const auto now = chrono::steady_clock::now();
+
+    // Unknown digests are handled entirely here, without a queue entry or
+    // a thread, so garbage input can't grow the server. The undefined macro
+    // is empty and never waits, so it plays inline, at most once per
+    // cooldown.
+    if (!known_macro(buf)) {
+      metrics::unknown_macros++;
+      app::unknown.record(buf, now);
+      bool allowed =
+          cooldown_allows(client, app::unknown_id, app::unknown_cooldown);
+      app::request_journal.append(journal_time(now), client->id, buf,
+                                  allowed ? journal_outcome::unknown
+                                          : journal_outcome::cooldown);
+      if (allowed) {
+        play_sequence(client->controllers, *undefined_macro, &resolver);
+      }
       continue;
     }
     {
-      std::lock_guard lck(client->mut);
-      client->input_queue.push(buf);
+      auto lck = trace::lock(client->mut, "wait client->mut");
+      client->input_queue.push({buf, now});
     }
   }
   client->ready_to_die = true;
@@ -132,79 +801,279 @@ void client_connection(client_info *client) {
 
 void client_input(client_info *client) {
   while (!client->ready_to_die) {
-    macro m;
+    request req;
     if (!check_queue_empty(client)) {
-      std::lock_guard lck(client->mut);
-      m = client->input_queue.front();
+      auto lck = trace::lock(client->mut, "wait client->mut");
+      req = client->input_queue.front();
       client->input_queue.pop();
     } else {
       goto skip;
     }
 
-    std::thread([m, client] {
-      auto now = chrono::high_resolution_clock::now();
-      if (!app::cooldown_specs.contains(m)) {
-        std::unique_lock lck(app::macro_mut);
-        app::cooldown_specs[m] = app::default_cooldown;
+    client->playing++;
+    if (app::realtime) {
+      if (!app::jobs.push({client, req, cancel_token{&client->cancel_epoch,
+                                                     client->cancel_epoch}})) {
+        std::cerr << "Playback queue full, dropping request" << std::endl;
+        metrics::dropped++;
+        app::request_journal.append(journal_time(req.received), client->id,
+                                    req.digest, journal_outcome::dropped);
+        client->playing--;
       }
-      {
-        std::unique_lock lck(app::macro_mut);
-        const auto &[base, increment, max] = app::cooldown_specs[m];
-        lck.unlock();
-        if (!client->cooldowns.contains(m)) {
-          std::lock_guard lck(client->mut);
-          client->cooldowns[m] = std::pair{now, base};
-        } else {
-          std::unique_lock lck(client->mut);
-          auto &[start, duration] = client->cooldowns[m];
-
-          auto elapsed = chrono::duration_cast<duration_t>(now - start);
-
-          if (elapsed < duration) {
-            duration = std::min(duration + increment, max);
-            //  NOTE: discuss wether to reset the start time here. i.e. if the
-            //  cooldown should reset fully or just extend
-            return;
-          }
-
-          duration = base;
-          start = now;
-        }
-      }
-
-      macro_sequence seq;
-      {
-        std::lock_guard lck(app::macro_mut);
-        if (app::macros.contains(m)) {
-          seq = app::macros.at(m);
-        } else {
-          seq = undefined_macro_seq;
-        }
-      }
-
-      std::cout << "Playing macro with hash: '" << m << "'" << std::endl;
-      play_sequence(client->controller, seq, &app::macros);
-    }).detach();
+    } else {
+      std::thread(play_request,
+                  playback_job{client, req,
+                               cancel_token{&client->cancel_epoch,
+                                            client->cancel_epoch}})
+          .detach();
+    }
 
   skip:
     std::this_thread::sleep_for(10ms);
   }
+  {
+    std::lock_guard lck(app::clients_mut);
+    app::clients.erase(client);
+  }
+  // Nobody can cancel this client's playbacks once it is out of the
+  // registry, so stop them here; an endless repeat would never finish.
+  client->cancel_epoch++;
+  // Playback threads still use the controller until they finish.
+  while (client->playing) {
+    std::this_thread::sleep_for(10ms);
+  }
   close(client->socket);
-  destroy_controller(client->controller);
   delete client;
   std::cout << "Destroyed client." << std::endl;
 }
 
-void pause_monitor() {
-  std::string input;
+std::string render_metrics() {
+  std::ostringstream os;
+  {
+    std::lock_guard lck(app::clients_mut);
+    os << "# TYPE barcode_clients gauge\n";
+    os << "barcode_clients " << app::clients.size() << "\n";
+    os << "# TYPE barcode_client_queue_depth gauge\n";
+    for (client_info *client : app::clients) {
+      std::lock_guard clck(client->mut);
+      os << "barcode_client_queue_depth{client=\"" << client->id << "\"} "
+         << client->input_queue.size() << "\n";
+    }
+  }
+
+  os << "# TYPE barcode_playbacks_in_flight gauge\n";
+  os << "barcode_playbacks_in_flight " << metrics::in_flight << "\n";
+
+  size_t threads = 0;
+  std::error_code ec;
+  for (auto it = fs::directory_iterator("/proc/self/task", ec);
+       !ec && it != fs::directory_iterator(); it.increment(ec)) {
+    threads++;
+  }
+  os << "# TYPE barcode_threads gauge\n";
+  os << "barcode_threads " << threads << "\n";
+
+  os << "# TYPE barcode_cooldown_rejections_total counter\n";
+  {
+    auto cat = app::loaded.read();
+    for (const auto &[m, id] : cat->ids) {
+      if (uint64_t n = app::rejections[id]) {
+        os << "barcode_cooldown_rejections_total{macro=\"" << m << "\"} "
+           << n << "\n";
+      }
+    }
+  }
+  if (uint64_t n = app::rejections[app::unknown_id]) {
+    os << "barcode_cooldown_rejections_total{macro=\"unknown\"} " << n
+       << "\n";
+  }
+
+  os << "# TYPE barcode_unknown_macros_total counter\n";
+  os << "barcode_unknown_macros_total " << metrics::unknown_macros << "\n";
+  {
+    std::lock_guard lck(app::unknown.mut);
+    os << "# TYPE barcode_unknown_digest_evictions_total counter\n";
+    os << "barcode_unknown_digest_evictions_total " << app::unknown.evictions
+       << "\n";
+  }
+  os << "# TYPE barcode_uinput_write_errors_total counter\n";
+  os << "barcode_uinput_write_errors_total " << write_errors << "\n";
+
+  {
+    std::lock_guard lck(app::macro_mut);
+    os << "# TYPE barcode_macro_cache_hits_total counter\n";
+    os << "barcode_macro_cache_hits_total " << app::cache.hits << "\n";
+    os << "# TYPE barcode_macro_cache_misses_total counter\n";
+    os << "barcode_macro_cache_misses_total " << app::cache.misses << "\n";
+    os << "# TYPE barcode_macro_cache_bytes gauge\n";
+    os << "barcode_macro_cache_bytes " << app::cache.bytes << "\n";
+  }
+
+  os << "# TYPE barcode_requests_total counter\n";
+  os << "barcode_requests_total " << metrics::requests << "\n";
+  os << "# TYPE barcode_playback_lag_seconds histogram\n";
+  metrics::playback_lag.write(os, "barcode_playback_lag_seconds");
+  os << "# TYPE barcode_playback_seconds histogram\n";
+  metrics::playback_seconds.write(os, "barcode_playback_seconds");
+  if (app::realtime) {
+    os << "# TYPE barcode_playback_queue_depth gauge\n";
+    os << "barcode_playback_queue_depth " << app::jobs.size() << "\n";
+    os << "# TYPE barcode_playbacks_dropped_total counter\n";
+    os << "barcode_playbacks_dropped_total " << metrics::dropped << "\n";
+  }
+  if (app::request_journal.enabled()) {
+    os << "# TYPE barcode_journal_dropped_total counter\n";
+    os << "barcode_journal_dropped_total " << app::request_journal.dropped
+       << "\n";
+  }
+  os << "# TYPE barcode_wait_overshoot_seconds histogram\n";
+  metrics::wait_overshoot.write(os, "barcode_wait_overshoot_seconds");
+  return os.str();
+}
+
+// Runs 'fn' on the client with the given id while holding the registry
+// lock. Returns false if there is no such client.
+template <typename F> bool with_client(const std::string &id, F fn) {
+  uint32_t n;
+  if (!parse_number(std::string_view(id), n)) {
+    return false;
+  }
+  std::lock_guard lck(app::clients_mut);
+  for (client_info *client : app::clients) {
+    if (client->id == n) {
+      fn(client);
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string write_trace() {
+  if (app::trace_path.empty()) {
+    return "Tracing is off, set trace_file in server.conf\n";
+  }
+  int64_t n = trace::write(app::trace_path);
+  if (n < 0) {
+    return "Failed to write trace to " + app::trace_path + "\n";
+  }
+  return "Wrote " + std::to_string(n) + " trace events to " +
+         app::trace_path +
+         (trace::dropped ? " (" + std::to_string(trace::dropped) +
+                               " dropped)\n"
+                         : "\n");
+}
+
+std::string control_command(const std::string &line) {
+  std::istringstream ss(line);
+  std::string command, arg;
+  ss >> command >> arg;
+
+  if (command == "pause" || command == "resume") {
+    bool pause = command == "pause";
+    if (arg.empty()) {
+      app::paused = pause;
+      return pause ? "Paused!\n" : "Resumed!\n";
+    }
+    if (!with_client(arg, [&](client_info *c) { c->paused = pause; })) {
+      return "No such client: " + arg + "\n";
+    }
+    return (pause ? "Paused client " : "Resumed client ") + arg + "\n";
+  } else if (command == "cancel") {
+    if (!with_client(arg, [](client_info *c) { c->cancel_epoch++; })) {
+      return "No such client: " + arg + "\n";
+    }
+    return "Cancelled playbacks of client " + arg + "\n";
+  } else if (command == "reload") {
+    return load_macros() ? "Reloaded macros\n"
+                         : "Reload failed, keeping current macros\n";
+  } else if (command == "clients") {
+    std::ostringstream os;
+    std::lock_guard lck(app::clients_mut);
+    for (client_info *client : app::clients) {
+      std::lock_guard clck(client->mut);
+      os << client->id << " queue " << client->input_queue.size()
+         << " playing " << client->playing
+         << (client->paused ? " paused" : "") << "\n";
+    }
+    return os.str();
+  } else if (command == "stats") {
+    return render_metrics();
+  } else if (command == "trace") {
+    return write_trace();
+  } else if (command == "unknown") {
+    std::ostringstream os;
+    const auto now = unknown_digests::clock::now();
+    for (const auto &e : app::unknown.snapshot(now)) {
+      os << e.digest << " count " << e.count << " last "
+         << chrono::duration_cast<chrono::seconds>(now - e.last_seen).count()
+         << "s ago\n";
+    }
+    return os.str();
+  }
+  return "Unknown command: " + command +
+         "\nCommands: pause [client], resume [client], cancel client, reload, "
+         "clients, stats, trace, unknown\n";
+}
+
+void control_connection(int conn) {
+  std::string buffer;
+  char chunk[256];
+  ssize_t n;
+  while ((n = recv(conn, chunk, sizeof(chunk), 0)) > 0) {
+    buffer.append(chunk, n);
+    size_t eol;
+    while ((eol = buffer.find('\n')) != std::string::npos) {
+      std::string reply = control_command(buffer.substr(0, eol));
+      buffer.erase(0, eol + 1);
+      send(conn, reply.data(), reply.size(), MSG_NOSIGNAL);
+    }
+  }
+  close(conn);
+}
+
+// Creates the operator socket, readable and writable by the owner only.
+// The mode comes from the umask at bind time, so there is no window in
+// which another user can connect; called before any other thread starts,
+// since the umask is process-wide. Returns -1 on failure.
+int open_control_socket() {
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    std::cerr << "Failed to create control socket" << std::endl;
+    return -1;
+  }
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (app::control_path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Control socket path too long" << std::endl;
+    close(sock);
+    return -1;
+  }
+  strcpy(addr.sun_path, app::control_path.c_str());
+  unlink(addr.sun_path);
+
+  mode_t old_mask = umask(0177);
+  bool bound = bind(sock, (sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(old_mask);
+  if (!bound || listen(sock, 4) < 0) {
+    std::cerr << "Failed to bind control socket " << app::control_path
+              << std::endl;
+    close(sock);
+    return -1;
+  }
+  std::cout << "Control socket at " << app::control_path << std::endl;
+  return sock;
+}
+
+// Accepts operator connections on the control socket. Each connection is
+// served on its own thread so a slow command never blocks another operator.
+void control_monitor(int sock) {
   while (app::running) {
-    std::cin >> input;
-    if (input != "pause") {
+    int conn = accept(sock, nullptr, nullptr);
+    if (conn < 0) {
       continue;
     }
-
-    app::paused = !app::paused;
-    std::cout << (app::paused ? "Paused!" : "Resumed!") << std::endl;
+    std::thread(control_connection, conn).detach();
   }
 }
 
@@ -271,21 +1140,25 @@ int main(void) {
   sa.sa_flags = 0;
   sigaction(SIGINT, &sa, nullptr);
 
-  termios term_info, save;
-  if (tcgetattr(STDIN_FILENO, &term_info) < 0) {
-    std::cerr << "Tcgetattr failed." << std::endl;
-    exit(EXIT_FAILURE);
+  read_conf();
+  int control_socket = open_control_socket();
+  trace::enabled = !app::trace_path.empty();
+  std::thread journal_writer;
+  if (!app::journal_path.empty() &&
+      app::request_journal.open(app::journal_path)) {
+    journal_writer =
+        std::thread([] { app::request_journal.run(app::running); });
   }
-  save = term_info;
-
-  term_info.c_lflag &= ~ECHO;
-  if (tcsetattr(STDIN_FILENO, TCSANOW, &term_info) < 0) {
-    std::cerr << "Tcsetattr failed." << std::endl;
+  on_wait_overshoot = [](chrono::nanoseconds late) {
+    metrics::wait_overshoot.observe(late);
+  };
+  if (app::realtime) {
+    start_realtime();
+  }
+  if (!load_macros()) {
     exit(EXIT_FAILURE);
   }
 
-  load_macros();
-
   conn::socket = socket(AF_INET, SOCK_STREAM, 0);
   if (conn::socket < 0) {
     std::cerr << "Failed to create socket" << std::endl;
@@ -309,7 +1182,12 @@ int main(void) {
     return 1;
   }
 
-  std::thread(pause_monitor).detach();
+  if (control_socket >= 0) {
+    std::thread(control_monitor, control_socket).detach();
+  }
+  if (app::metrics_port) {
+    std::thread(metrics::serve, app::metrics_port, render_metrics).detach();
+  }
   while (app::running) {
     int client_socket = accept(conn::socket, nullptr, nullptr);
     if (client_socket < 0) {
@@ -324,21 +1202,38 @@ int main(void) {
     client_info *client = new client_info{
         .socket = client_socket,
         .mut = std::mutex{},
-        .input_queue = std::queue<macro>{},
-        .controller = controller_init(),
-        .cooldowns = decltype(client_info::cooldowns){},
+        .input_queue = std::queue<request>{},
+        .controllers = controller_set(app::null_controller),
+        .cooldowns = {},
         .ready_to_die = false,
+        .id = app::next_client_id++,
+        .playing = 0,
+        .paused = false,
+        .cancel_epoch = 0,
     };
+    {
+      std::lock_guard lck(app::clients_mut);
+      client->cooldowns.reserve(app::reserved_ids);
+      app::clients.insert(client);
+    }
 
     std::thread(client_connection, client).detach();
     std::thread(client_input, client).detach();
   }
 
   close(conn::socket);
-
-  if (tcsetattr(STDIN_FILENO, TCSANOW, &save) < 0) {
-    std::cerr << "Tcsetattr failed. Run ttysane to restore a reasonable state."
+  unlink(app::control_path.c_str());
+  if (trace::enabled) {
+    std::cout << write_trace();
+  }
+  if (journal_writer.joinable()) {
+    journal_writer.join();
+    app::request_journal.flush();
+    std::cout << "Journaled " << app::request_journal.written << " requests"
               << std::endl;
-    exit(EXIT_FAILURE);
+    if (app::request_journal.dropped) {
+      std::cerr << "Dropped " << app::request_journal.dropped
+                << " journal records while the buffer was full" << std::endl;
+    }
   }
 }
@@ -0,0 +1,159 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Chrome trace-event recorder. Events collect in memory while enabled and
+// are written as JSON that chrome://tracing and ui.perfetto.dev can open.
+// Requests are async spans on one track per client; everything else is a
+// span or instant on the track of the thread that did it.
+namespace trace {
+
+using clock = std::chrono::steady_clock;
+
+inline std::atomic_bool enabled = false;
+
+// Track groups, shown as processes in the viewer.
+constexpr uint32_t client_pid = 1;
+constexpr uint32_t thread_pid = 2;
+
+// Past this many events new ones are counted but not kept.
+constexpr size_t max_events = 1 << 20;
+
+struct event {
+  const char *name;
+  const char *cat;
+  char ph;
+  uint32_t pid, tid;
+  int64_t ts_us, dur_us;
+  uint64_t id;
+  // Body of the "args" object, already JSON, e.g. "\"ms\":50".
+  std::string args;
+};
+
+inline std::mutex mut;
+inline std::vector<event> events;
+inline std::atomic<uint64_t> dropped = 0;
+inline const clock::time_point epoch = clock::now();
+
+inline int64_t us(clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(t - epoch)
+      .count();
+}
+
+// Small dense id for the calling thread's track.
+inline uint32_t thread_track() {
+  static std::atomic<uint32_t> next = 0;
+  thread_local uint32_t id = next++;
+  return id;
+}
+
+inline void record(event e) {
+  std::lock_guard lck(mut);
+  if (events.size() >= max_events) {
+    dropped++;
+    return;
+  }
+  events.push_back(std::move(e));
+}
+
+// A span from 'start' to 'end' on this thread's track.
+inline void complete(const char *name, const char *cat, clock::time_point start,
+                     clock::time_point end, std::string args = {}) {
+  record({name, cat, 'X', thread_pid, thread_track(), us(start),
+          us(end) - us(start), 0, std::move(args)});
+}
+
+inline void instant(const char *name, const char *cat, std::string args = {}) {
+  record({name, cat, 'i', thread_pid, thread_track(), us(clock::now()), 0, 0,
+          std::move(args)});
+}
+
+// Async spans may overlap on the same track, as requests from one client
+// do. 'id' pairs a begin with its end.
+inline void async_begin(const char *name, uint32_t client, uint64_t id,
+                        clock::time_point t, std::string args = {}) {
+  record({name, "request", 'b', client_pid, client, us(t), 0, id,
+          std::move(args)});
+}
+
+inline void async_end(const char *name, uint32_t client, uint64_t id,
+                      std::string args = {}) {
+  record({name, "request", 'e', client_pid, client, us(clock::now()), 0, id,
+          std::move(args)});
+}
+
+// Records a span covering its own lifetime on this thread's track.
+struct span {
+  const char *name, *cat;
+  clock::time_point start;
+  bool on;
+  std::string args;
+
+  span(const char *name, const char *cat)
+      : name(name), cat(cat), start(clock::now()), on(enabled) {}
+  ~span() {
+    if (on) {
+      complete(name, cat, start, clock::now(), std::move(args));
+    }
+  }
+};
+
+// Locks 'm', recording the time spent waiting if someone else held it.
+template <typename M>
+std::unique_lock<M> lock(M &m, const char *name) {
+  std::unique_lock lck(m, std::try_to_lock);
+  if (!lck.owns_lock()) {
+    auto start = clock::now();
+    lck.lock();
+    if (enabled) {
+      complete(name, "lock", start, clock::now());
+    }
+  }
+  return lck;
+}
+
+// Writes everything recorded so far. Returns the number of events, or -1 if
+// the file couldn't be written.
+inline int64_t write(const std::string &path) {
+  std::ofstream f(path);
+  if (!f.is_open()) {
+    return -1;
+  }
+  std::lock_guard lck(mut);
+  f << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  f << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << client_pid
+    << ",\"args\":{\"name\":\"clients\"}},\n";
+  f << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << thread_pid
+    << ",\"args\":{\"name\":\"threads\"}}";
+  std::set<std::pair<uint32_t, uint32_t>> tracks;
+  for (const auto &e : events) {
+    tracks.insert({e.pid, e.tid});
+    f << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"" << e.cat
+      << "\",\"ph\":\"" << e.ph << "\",\"pid\":" << e.pid
+      << ",\"tid\":" << e.tid << ",\"ts\":" << e.ts_us;
+    if (e.ph == 'X') {
+      f << ",\"dur\":" << e.dur_us;
+    } else if (e.ph == 'i') {
+      f << ",\"s\":\"t\"";
+    } else {
+      f << ",\"id\":" << e.id;
+    }
+    f << ",\"args\":{" << e.args << "}}";
+  }
+  for (const auto &[pid, tid] : tracks) {
+    f << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+      << ",\"tid\":" << tid << ",\"args\":{\"name\":\""
+      << (pid == client_pid ? "client " : "thread ") << tid << "\"}}";
+  }
+  f << "\n]}\n";
+  return events.size();
+}
+
+} // namespace trace
@@ -0,0 +1,79 @@
+#pragma once
+#include "macros.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+// Fixed-size table of recently seen unknown digests and how often each was
+// sent, for spotting misprinted barcodes without letting garbage input grow
+// the server. Entries not seen for 'ttl' are dropped, and when a set is full
+// its least recently seen entry makes room. Recording never allocates.
+struct unknown_digests {
+  static constexpr size_t sets = 64;
+  static constexpr size_t ways = 4;
+  static constexpr std::chrono::minutes ttl{10};
+
+  using clock = std::chrono::steady_clock;
+
+  struct entry {
+    macro digest;
+    uint64_t count = 0;
+    clock::time_point first_seen, last_seen;
+  };
+
+  std::mutex mut;
+  std::array<entry, sets * ways> entries{};
+  uint64_t evictions = 0;
+
+  void record(const macro &m, clock::time_point now = clock::now()) {
+    uint64_t h;
+    std::memcpy(&h, m.data, sizeof(h));
+    entry *set = &entries[(h % sets) * ways];
+
+    std::lock_guard lck(mut);
+    entry *victim = set;
+    for (size_t w = 0; w < ways; w++) {
+      entry &e = set[w];
+      if (e.count && now - e.last_seen > ttl) {
+        e.count = 0;
+      }
+      if (e.count && e.digest == m) {
+        e.count++;
+        e.last_seen = now;
+        return;
+      }
+      if (!victim->count) {
+        continue;
+      }
+      if (!e.count || e.last_seen < victim->last_seen) {
+        victim = &e;
+      }
+    }
+    if (victim->count) {
+      evictions++;
+    }
+    *victim = {m, 1, now, now};
+  }
+
+  // Live entries, most frequent first.
+  std::vector<entry> snapshot(clock::time_point now = clock::now()) {
+    std::vector<entry> out;
+    {
+      std::lock_guard lck(mut);
+      for (const entry &e : entries) {
+        if (e.count && now - e.last_seen <= ttl) {
+          out.push_back(e);
+        }
+      }
+    }
+    std::sort(out.begin(), out.end(), [](const entry &a, const entry &b) {
+      return a.count > b.count;
+    });
+    return out;
+  }
+};